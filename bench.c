@@ -0,0 +1,732 @@
+/*
+ * Benchmark of dump/restore hot paths (make bench)
+ *
+ * Copyright (c) 2021 stzlab
+ *
+ * This software is released under the MIT License, see LICENSE.
+ */
+
+/* Built with the functions of fdm.c, its main is renamed away */
+#define main fdmMain
+#include "fdm.c"
+#undef main
+
+#define BENCHREPEAT			5			/* Runs of each benchmark, the fastest one is reported */
+#define BENCHRPM			360
+
+/* Synthetic image of the corpus */
+struct bench_image {
+	const char *name;
+	int media;
+	int cyls;
+	int mult;								/* Step of the emulated 2HD drive */
+	int kbps;
+	int drate;
+	int sects;
+	int n;
+	int interleave;
+	int protect;							/* Put copy protection on some tracks */
+};
+
+static const struct bench_image Corpus[] = {
+	{ "2d",    D88_TYPE_2D,  40, 2, 300, 1, 16, 1, 1, 0 },
+	{ "2dd",   D88_TYPE_2DD, 80, 1, 300, 1,  9, 2, 1, 0 },
+	{ "2hd",   D88_TYPE_2HD, 77, 1, 500, 0,  8, 3, 1, 0 },
+	{ "inter", D88_TYPE_2HD, 77, 1, 500, 0, 26, 1, 3, 0 },
+	{ "prot",  D88_TYPE_2HD, 77, 1, 500, 0,  8, 3, 1, 1 },
+};
+#define CORPUSNUM			(int)(sizeof(Corpus) / sizeof(Corpus[0]))
+
+/* Optimize modes of end-to-end runs */
+struct bench_preset {
+	const char *name;
+	int optimize;
+};
+
+static const struct bench_preset Preset[] = {
+	{ "none",    0 },
+	{ "fast",    OPTIMIZE_MULTI | OPTIMIZE_BATCH | OPTIMIZE_PREDICT | OPTIMIZE_PROBE | OPTIMIZE_FILL | OPTIMIZE_MT },
+	{ "sched",   OPTIMIZE_SCHED | OPTIMIZE_PREDICT | OPTIMIZE_PROBE },
+	{ "capture", OPTIMIZE_CAPTURE | OPTIMIZE_PROBE },
+};
+#define PRESETNUM			(int)(sizeof(Preset) / sizeof(Preset[0]))
+
+/* Result of an end-to-end run */
+struct bench_result {
+	long long time;							/* Emulated time [usec] */
+	long long commands;
+	long long errors;
+	long long wall;							/* Host time of the fastest run [nsec] */
+	int differ;								/* Tracks different from the source image */
+};
+
+static FILE *Out;
+static char Dir[PATH_MAX];
+static volatile unsigned int Sink;
+
+static long long getWallTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned int nextRandom(unsigned int *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/* Sectors of a track in physical order, protection is put on every fifth cylinder */
+static int makeTrack(const struct bench_image *bi, int trk, struct D88_SECTOR *sec, unsigned char **data)
+{
+	int cnt;
+	int pos;
+	int len;
+	int cyl = trk / 2;
+	int head = trk % 2;
+	int sects = bi->sects;
+	int kind = ((bi->protect != 0) && (cyl % 5 == 2)) ? (cyl / 5) % 7 : -1;
+	unsigned int seed;
+	unsigned char used[MAXSECNUM];
+
+	if (kind == 3) {
+		/* Unformatted track */
+		return 0;
+	}
+	memset(used, 0, sizeof(used));
+	memset(sec, 0, sizeof(*sec) * sects);
+	for (cnt = 0, pos = 0; cnt < sects; cnt++) {
+		/* Interleave, next free slot when taken */
+		while (used[pos] != 0) {
+			pos = (pos + 1) % sects;
+		}
+		used[pos] = 1;
+		sec[pos].c = cyl;
+		sec[pos].h = head;
+		sec[pos].r = cnt + 1;
+		sec[pos].n = bi->n;
+		pos = (pos + bi->interleave) % sects;
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		sec[cnt].wSectors = sects;
+		/* Track 0 of 2D is FM with 128 bytes sectors */
+		sec[cnt].bEncoding = ((bi->media == D88_TYPE_2D) && (trk == 0)) ? D88_ENCODE_FM : D88_ENCODE_MFM;
+		sec[cnt].n = (sec[cnt].bEncoding == D88_ENCODE_FM) ? 0 : sec[cnt].n;
+	}
+	switch (kind) {
+		case 0:
+			sec[2].bStatus = D88_STATUS_DD;
+			break;
+		case 1:
+			sec[4].bDataAddressMark = D88_DAM_DELETED;
+			sec[4].bStatus = D88_STATUS_CM;
+			break;
+		case 2:
+			sec[sects - 1].n = bi->n - 1;
+			break;
+		case 4:
+			sec[1].c = cyl + 1;
+			break;
+		case 5:
+			sec[sects - 1].r = 1;
+			break;
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		len = NSECSIZE(sec[cnt].n);
+		/* Sectors stored shorter than N, padded with zero on restore */
+		len = ((kind == 6) && (sec[cnt].r % 3 == 0)) ? 100 : len;
+		sec[cnt].wLength = len;
+		if ((data[cnt] = malloc(len)) == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		/* Uniform sectors for the fill mode, the others are random */
+		if ((trk + sec[cnt].r) % 4 == 0) {
+			memset(data[cnt], 0xe5, len);
+			continue;
+		}
+		seed = (trk << 8) + sec[cnt].r + 1;
+		for (pos = 0; pos < len; pos++) {
+			data[cnt][pos] = nextRandom(&seed);
+		}
+	}
+	return sects;
+}
+
+static int makeImage(const struct bench_image *bi, const char *path)
+{
+	int trk;
+	int cnt;
+	int sects;
+	int ret = 0;
+	unsigned int offset = sizeof(struct D88_HEADER);
+	FILE *fp;
+	struct D88_HEADER dsk;
+	struct D88_SECTOR sec[MAXSECNUM];
+	unsigned char *data[MAXSECNUM];
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	memset(&dsk, 0, sizeof(dsk));
+	dsk.bMediaType = bi->media;
+	fwrite(&dsk, sizeof(dsk), 1, fp);
+	for (trk = 0; (trk < bi->cyls * 2) && (ret == 0); trk++) {
+		if ((sects = makeTrack(bi, trk, sec, data)) < 0) {
+			ret = -1;
+			break;
+		}
+		if (sects != 0) {
+			dsk.adwTrackOffsets[trk] = offset;
+		}
+		for (cnt = 0; cnt < sects; cnt++) {
+			if ((fwrite(&sec[cnt], sizeof(sec[cnt]), 1, fp) != 1) || (fwrite(data[cnt], sec[cnt].wLength, 1, fp) != 1)) {
+				perror("fwrite");
+				ret = -1;
+			}
+			offset += sizeof(sec[cnt]) + sec[cnt].wLength;
+			free(data[cnt]);
+		}
+	}
+	dsk.dwDiskSize = offset;
+	if ((ret == 0) && ((fseek(fp, 0, SEEK_SET) != 0) || (fwrite(&dsk, sizeof(dsk), 1, fp) != 1))) {
+		perror("fwrite");
+		ret = -1;
+	}
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/* Image without formatted tracks */
+static int makeBlank(const struct bench_image *bi, const char *path)
+{
+	FILE *fp;
+	struct D88_HEADER dsk;
+
+	memset(&dsk, 0, sizeof(dsk));
+	dsk.bMediaType = bi->media;
+	dsk.dwDiskSize = sizeof(dsk);
+	if ((fp = fopen(path, "wb")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	if (fwrite(&dsk, sizeof(dsk), 1, fp) != 1) {
+		perror("fwrite");
+		fclose(fp);
+		return -1;
+	}
+	return (fclose(fp) == 0) ? 0 : -1;
+}
+
+/* Count tracks whose sector headers or data differ */
+static int compareImage(const char *src, const char *dst, int tracks)
+{
+	int trk;
+	int cnt;
+	int differ = 0;
+	struct d88_image a;
+	struct d88_image b;
+	struct d88_track *ta;
+	struct d88_track *tb;
+	struct D88_SECTOR sec;
+
+	if (d88Open(&a, src, MAXSECNUM) != 0) {
+		return -1;
+	}
+	if (d88Open(&b, dst, MAXSECNUM) != 0) {
+		d88Close(&a);
+		return -1;
+	}
+	for (trk = 0; trk < tracks; trk++) {
+		ta = &a.trk[trk];
+		tb = &b.trk[trk];
+		if (ta->sects != tb->sects) {
+			differ++;
+			continue;
+		}
+		for (cnt = 0; cnt < ta->sects; cnt++) {
+			/* Short sectors of the source come back in the size of N, compared up to the source length */
+			sec = tb->sec[cnt];
+			sec.wLength = (sec.wLength > ta->sec[cnt].wLength) ? ta->sec[cnt].wLength : sec.wLength;
+			if ((memcmp(&ta->sec[cnt], &sec, sizeof(sec)) != 0)
+				|| (memcmp(ta->data[cnt], tb->data[cnt], ta->sec[cnt].wLength) != 0)) {
+				differ++;
+				break;
+			}
+		}
+	}
+	d88Close(&a);
+	d88Close(&b);
+	return differ;
+}
+
+/* Open the emulator at the next index, so every run starts at the same rotational phase */
+static int openEmulator(const struct bench_image *bi, const char *path)
+{
+	long long rev = fdcGetRevTime();
+	struct fdc_res_intr intr;
+
+	fdcSetBackend(&fdcEmulator, path);
+	fdcSyncTime((fdcGetTime() / rev + 1) * rev);
+	if (fdcInit() != 0) {
+		return -1;
+	}
+	fdcSetDataRate(bi->drate);
+	do {
+		if (fdcRecalibrate(FD_DEVNUM, &intr) != 0) {
+			fdcExit();
+			return -1;
+		}
+	} while ((intr.st0 & FDC_ST0_EC) != 0);
+	return 0;
+}
+
+static void sumStats(struct fdc_stat *before, struct fdc_stat *after, struct bench_result *r)
+{
+	int cnt;
+
+	r->commands = 0;
+	r->errors = 0;
+	for (cnt = 0; cnt < FDC_STAT_NUM; cnt++) {
+		r->commands += after[cnt].count - before[cnt].count;
+		r->errors += after[cnt].errors - before[cnt].errors;
+	}
+}
+
+static int runDump(const struct bench_image *bi, const char *src, const char *dst, struct bench_result *r)
+{
+	int ret;
+	long long time;
+	long long wall;
+	struct fdc_stat before[FDC_STAT_NUM];
+	struct fdc_stat after[FDC_STAT_NUM];
+
+	if (openEmulator(bi, src) != 0) {
+		return -1;
+	}
+	fdcGetStats(before, 1);
+	time = fdcGetTime();
+	wall = getWallTime();
+	ret = dumpFloppyDisk(0, bi->cyls - 1, bi->mult, 2, bi->media, D88_PROTECT_OFF, 0, 0,
+		calcTrackLength(BENCHRPM, bi->kbps), (char *)dst, NULL, NULL, NULL);
+	wall = getWallTime() - wall;
+	r->time = fdcGetTime() - time;
+	fdcGetStats(after, 1);
+	fdcExit();
+	sumStats(before, after, r);
+	r->wall = ((r->wall == 0) || (wall < r->wall)) ? wall : r->wall;
+	return ret;
+}
+
+static int runRestore(const struct bench_image *bi, const char *src, const char *dst, struct bench_result *r)
+{
+	int ret;
+	int tracks;
+	int trklen = calcTrackLength(BENCHRPM, bi->kbps);
+	long long time;
+	long long wall;
+	struct d88_image img;
+	struct track_plan *plan;
+	struct fdc_stat before[FDC_STAT_NUM];
+	struct fdc_stat after[FDC_STAT_NUM];
+
+	/* Blank disk of the media every run, the image is saved when the emulator is closed */
+	if (makeBlank(bi, dst) != 0) {
+		return -1;
+	}
+	if (d88Open(&img, src, MAXSECNUM) != 0) {
+		return -1;
+	}
+	if ((tracks = compileRestorePlan(&plan, &img, 0, bi->cyls - 1, 2, trklen)) < 0) {
+		d88Close(&img);
+		return -1;
+	}
+	if (openEmulator(bi, dst) != 0) {
+		free(plan);
+		d88Close(&img);
+		return -1;
+	}
+	fdcGetStats(before, 1);
+	time = fdcGetTime();
+	wall = getWallTime();
+	ret = restoreFloppyDisk(bi->mult, 2, trklen, 0, 0, &img, plan, tracks);
+	wall = getWallTime() - wall;
+	r->time = fdcGetTime() - time;
+	fdcGetStats(after, 1);
+	fdcExit();
+	free(plan);
+	d88Close(&img);
+	sumStats(before, after, r);
+	r->wall = ((r->wall == 0) || (wall < r->wall)) ? wall : r->wall;
+	return ret;
+}
+
+static void printResult(const char *op, const struct bench_image *bi, const struct bench_preset *bp,
+	struct bench_result *r, int wall, int base)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s/%s/%s", op, bi->name, bp->name);
+	fprintf(Out, "e2e   %-24s %10lld.%.3lld %9.1f %8lld %6lld %6d", name, r->time / 1000000, (r->time / 1000) % 1000,
+		(double)r->time / fdcGetRevTime(), r->commands, r->errors, r->differ);
+	if (wall != 0) {
+		fprintf(Out, " %10.3f", r->wall / 1000000.0);
+	}
+	/* Marked when the preset loses more tracks than the none preset on the same image */
+	fprintf(Out, "%s\n", (r->differ > base) ? " *" : "");
+}
+
+/* Dump and restore every image of the corpus with each preset, returns the number of regressed results */
+static int benchEndToEnd(int wall)
+{
+	int img;
+	int pre;
+	int rep;
+	int base = 0;
+	int regress = 0;
+	char src[PATH_MAX + 16];
+	char dst[PATH_MAX + 16];
+	struct bench_result r;
+
+	fprintf(Out, "#     %-24s %14s %9s %8s %6s %6s%s\n", "name", "emulated[s]", "revs", "commands", "errors", "differ",
+		(wall != 0) ? "   wall[ms]" : "");
+	for (img = 0; img < CORPUSNUM; img++) {
+		snprintf(src, sizeof(src), "%s/%s.d88", Dir, Corpus[img].name);
+		snprintf(dst, sizeof(dst), "%s/out.d88", Dir);
+		for (pre = 0; pre < PRESETNUM; pre++) {
+			optimize = Preset[pre].optimize;
+			memset(&r, 0, sizeof(r));
+			for (rep = 0; rep < ((wall != 0) ? BENCHREPEAT : 1); rep++) {
+				if (runDump(&Corpus[img], src, dst, &r) != 0) {
+					return -1;
+				}
+			}
+			r.differ = compareImage(src, dst, Corpus[img].cyls * 2);
+			/* Preset[0] (none) is the reference of the image */
+			base = (pre == 0) ? r.differ : base;
+			regress += (r.differ > base) ? 1 : 0;
+			printResult("dump", &Corpus[img], &Preset[pre], &r, wall, base);
+		}
+		for (pre = 0; pre < PRESETNUM; pre++) {
+			/* READ TRACK and scheduled reads are not used by restore */
+			if ((Preset[pre].optimize & (OPTIMIZE_CAPTURE | OPTIMIZE_SCHED)) != 0) {
+				continue;
+			}
+			optimize = Preset[pre].optimize;
+			memset(&r, 0, sizeof(r));
+			for (rep = 0; rep < ((wall != 0) ? BENCHREPEAT : 1); rep++) {
+				if (runRestore(&Corpus[img], src, dst, &r) != 0) {
+					return -1;
+				}
+			}
+			r.differ = compareImage(src, dst, Corpus[img].cyls * 2);
+			/* Preset[0] (none) is the reference of the image */
+			base = (pre == 0) ? r.differ : base;
+			regress += (r.differ > base) ? 1 : 0;
+			printResult("restore", &Corpus[img], &Preset[pre], &r, wall, base);
+		}
+	}
+	optimize = 0;
+	unlink(dst);
+	if (regress != 0) {
+		fprintf(Out, "# %d results differ from the source more than the none preset (marked *)\n", regress);
+	}
+	return regress;
+}
+
+/* State shared by the microbenchmarks, built from the 2HD image of the corpus */
+struct micro_ctx {
+	char path[PATH_MAX + 16];
+	struct d88_image img;
+	struct track_plan *plan;
+	int tracks;
+	struct track_buffer tb;
+	struct cylinder_cache cc;
+	unsigned char raw[MAXTRKLEN];
+	unsigned char runBuf[MAXTRKLEN];
+	int null;
+};
+
+static void microD88Open(struct micro_ctx *ctx, long iter)
+{
+	struct d88_image img;
+
+	while (iter-- > 0) {
+		if (d88Open(&img, ctx->path, MAXSECNUM) == 0) {
+			Sink += img.trk[0].sects;
+			d88Close(&img);
+		}
+	}
+}
+
+static void microRestorePlan(struct micro_ctx *ctx, long iter)
+{
+	struct track_plan *plan;
+	int tracks;
+
+	while (iter-- > 0) {
+		if ((tracks = compileRestorePlan(&plan, &ctx->img, 0, 76, 2, calcTrackLength(BENCHRPM, 500))) > 0) {
+			Sink += plan[tracks - 1].groups;
+			free(plan);
+		}
+	}
+}
+
+/* Track image serialization of the dump writer */
+static void microTrackImage(struct micro_ctx *ctx, long iter)
+{
+	while (iter-- > 0) {
+		Sink += writeTrackImage(ctx->null, &ctx->tb);
+	}
+}
+
+static void microConvertStatus(struct micro_ctx *ctx, long iter)
+{
+	int cnt;
+	struct fdc_res_cmd res;
+
+	memset(&res, 0, sizeof(res));
+	while (iter-- > 0) {
+		/* Every bit of ST1 and ST2 with normal and abnormal end */
+		for (cnt = 0; cnt < 32; cnt++) {
+			res.st0 = (cnt & 0x10) ? 0x40 : 0x00;
+			res.st1 = 1 << (cnt & 7);
+			res.st2 = (cnt & 8) ? 1 << (cnt & 7) : 0;
+			Sink += convertStatus(&res);
+		}
+	}
+}
+
+static void microFormatGap(struct micro_ctx *ctx, long iter)
+{
+	int n;
+	int sects;
+
+	while (iter-- > 0) {
+		for (n = 0; n < 4; n++) {
+			for (sects = 1; sects <= 32; sects++) {
+				Sink += calcFormatGapLen(10416, n, sects, D88_ENCODE_MFM);
+				Sink += calcFormatGapLen(5208, n, sects, D88_ENCODE_FM);
+			}
+		}
+	}
+}
+
+/* Buffer layout of a track before its sectors are read */
+static void microTrackBuffer(struct micro_ctx *ctx, long iter)
+{
+	while (iter-- > 0) {
+		Sink += setTrackBuffer(&ctx->tb, ctx->tb.sects, D88_ENCODE_MFM);
+	}
+}
+
+/* Head 1 copied from the multi-track read of the cylinder */
+static void microCylinderCache(struct micro_ctx *ctx, long iter)
+{
+	while (iter-- > 0) {
+		ctx->cc.valid = 1;
+		Sink += readCylinderCache(&ctx->tb, &ctx->cc);
+	}
+}
+
+/* Sector data picked from a READ TRACK stream at a bit offset */
+static void microCaptureData(struct micro_ctx *ctx, long iter)
+{
+	int cnt;
+	struct trk_sector sec;
+
+	memset(&sec, 0, sizeof(sec));
+	sec.id.n = 3;
+	while (iter-- > 0) {
+		for (cnt = 0; cnt < 8; cnt++) {
+			sec.dataBit = cnt * (NSECSIZE(3) + 62) * 8 + cnt;
+			trkGetData(ctx->raw, sizeof(ctx->raw), &sec, ctx->tb.data[cnt]);
+		}
+		Sink += ctx->tb.data[7][0];
+	}
+}
+
+/* Sectors gathered into the buffer of multi-sector writes */
+static void microWriteRun(struct micro_ctx *ctx, long iter)
+{
+	int cnt;
+	int trk;
+	unsigned char *buf;
+	struct track_plan *plan;
+
+	while (iter-- > 0) {
+		for (trk = 0; trk < ctx->tracks; trk++) {
+			plan = &ctx->plan[trk];
+			for (cnt = 0, buf = ctx->runBuf; cnt < plan->sects; cnt++) {
+				memcpy(buf, plan->data[cnt], plan->sec[cnt].wLength);
+				buf += plan->sec[cnt].wLength;
+			}
+		}
+		Sink += ctx->runBuf[0];
+	}
+}
+
+static void microFillSectors(struct micro_ctx *ctx, long iter)
+{
+	int trk;
+	struct track_plan *plan;
+	unsigned char filled[MAXSECNUM];
+
+	while (iter-- > 0) {
+		for (trk = 0; trk < ctx->tracks; trk++) {
+			plan = &ctx->plan[trk];
+			Sink += setFillSectors(plan->sec, plan->sects, plan->data, filled);
+		}
+	}
+}
+
+struct micro_bench {
+	const char *name;
+	void (*func)(struct micro_ctx *ctx, long iter);
+	long iter;
+};
+
+static const struct micro_bench Micro[] = {
+	{ "d88_open/2hd",        microD88Open,       200 },
+	{ "restore_plan/2hd",    microRestorePlan,   200 },
+	{ "track_image/8x1024",  microTrackImage,    20000 },
+	{ "convert_status",      microConvertStatus, 100000 },
+	{ "format_gap",          microFormatGap,     20000 },
+	{ "track_buffer/8x1024", microTrackBuffer,   50000 },
+	{ "cylinder_cache/8x1024", microCylinderCache, 50000 },
+	{ "capture_data/8x1024", microCaptureData,   20000 },
+	{ "write_run/2hd",       microWriteRun,      200 },
+	{ "fill_sectors/2hd",    microFillSectors,   200 },
+};
+#define MICRONUM			(int)(sizeof(Micro) / sizeof(Micro[0]))
+
+static int benchMicro(void)
+{
+	int cnt;
+	int rep;
+	unsigned int seed = 1;
+	long long wall;
+	long long best;
+	struct micro_ctx *ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	snprintf(ctx->path, sizeof(ctx->path), "%s/2hd.d88", Dir);
+	if ((ctx->null = open("/dev/null", O_WRONLY)) < 0) {
+		perror("open");
+		free(ctx);
+		return -1;
+	}
+	if ((d88Open(&ctx->img, ctx->path, MAXSECNUM) != 0)
+		|| ((ctx->tracks = compileRestorePlan(&ctx->plan, &ctx->img, 0, 76, 2, calcTrackLength(BENCHRPM, 500))) < 0)) {
+		close(ctx->null);
+		free(ctx);
+		return -1;
+	}
+	/* Track 2 of the image as the read track, head 1 of it in the cylinder cache */
+	memcpy(ctx->tb.sec, ctx->img.trk[2].sec, sizeof(struct D88_SECTOR) * ctx->img.trk[2].sects);
+	for (cnt = 0; cnt < ctx->img.trk[2].sects; cnt++) {
+		memcpy(&ctx->tb.id[cnt], &ctx->tb.sec[cnt].c, sizeof(ctx->tb.id[cnt]));
+		memcpy(&ctx->cc.id[cnt], &ctx->tb.sec[cnt].c, sizeof(ctx->cc.id[cnt]));
+		ctx->cc.id[cnt].h = 1;
+	}
+	ctx->cc.sects = ctx->img.trk[2].sects;
+	setTrackBuffer(&ctx->tb, ctx->img.trk[2].sects, D88_ENCODE_MFM);
+	for (cnt = 0; cnt < ctx->tb.sects; cnt++) {
+		memcpy(ctx->tb.data[cnt], ctx->img.trk[2].data[cnt], ctx->tb.sec[cnt].wLength);
+	}
+	for (cnt = 0; cnt < (int)sizeof(ctx->raw); cnt++) {
+		ctx->raw[cnt] = nextRandom(&seed);
+	}
+	memcpy(ctx->cc.buf, ctx->raw, sizeof(ctx->cc.buf));
+
+	fprintf(Out, "#     %-24s %14s %14s\n", "name", "iterations", "ns/op");
+	for (cnt = 0; cnt < MICRONUM; cnt++) {
+		best = 0;
+		for (rep = 0; rep < BENCHREPEAT; rep++) {
+			wall = getWallTime();
+			Micro[cnt].func(ctx, Micro[cnt].iter);
+			wall = getWallTime() - wall;
+			best = ((best == 0) || (wall < best)) ? wall : best;
+		}
+		fprintf(Out, "micro %-24s %14ld %14.1f\n", Micro[cnt].name, Micro[cnt].iter, (double)best / Micro[cnt].iter);
+	}
+	free(ctx->tb.buf);
+	free(ctx->plan);
+	d88Close(&ctx->img);
+	close(ctx->null);
+	free(ctx);
+	return 0;
+}
+
+static void removeCorpus(void)
+{
+	int img;
+	char path[PATH_MAX + 16];
+
+	for (img = 0; img < CORPUSNUM; img++) {
+		snprintf(path, sizeof(path), "%s/%s.d88", Dir, Corpus[img].name);
+		unlink(path);
+	}
+	rmdir(Dir);
+}
+
+int main(int argc, char *argv[])
+{
+	int img;
+	int opt;
+	int ret = 0;
+	int wall = 1;
+	char path[PATH_MAX + 16];
+
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		switch (opt) {
+			case 'n':
+				wall = 0;
+				break;
+			default:
+				fprintf(stderr, "Usage: fdmbench [-n]\n");
+				fprintf(stderr, "  -n : emulated results only, no host time (identical between runs)\n");
+				exit(1);
+		}
+	}
+
+	/* Results go to the original stdout, the trace of dump/restore is discarded */
+	if (((Out = fdopen(dup(STDOUT_FILENO), "w")) == NULL) || (freopen("/dev/null", "w", stdout) == NULL)) {
+		perror("fdopen");
+		exit(1);
+	}
+	snprintf(Dir, sizeof(Dir), "%s/fdmbench.XXXXXX", (getenv("TMPDIR") != NULL) ? getenv("TMPDIR") : "/tmp");
+	if (mkdtemp(Dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	for (img = 0; img < CORPUSNUM; img++) {
+		snprintf(path, sizeof(path), "%s/%s.d88", Dir, Corpus[img].name);
+		if (makeImage(&Corpus[img], path) != 0) {
+			removeCorpus();
+			exit(1);
+		}
+	}
+	fdcSetRpm(BENCHRPM);
+
+	fprintf(Out, "# fdm bench (emulated %d rpm drive)\n", BENCHRPM);
+	if ((wall != 0) && (benchMicro() != 0)) {
+		ret = 1;
+	}
+	if ((ret == 0) && (benchEndToEnd(wall) != 0)) {
+		ret = 1;
+	}
+	fclose(Out);
+	removeCorpus();
+	return ret;
+}
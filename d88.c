@@ -0,0 +1,126 @@
+/*
+ * Implementation for D88 disk image file reader
+ *
+ * Copyright (c) 2021 stzlab
+ *
+ * This software is released under the MIT License, see LICENSE.
+ */
+
+#include "d88.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Index sectors of a track, checks every header and data lies in the image */
+static int d88IndexTrack(struct d88_image *img, int trk, long limit, int maxSects)
+{
+	int cnt;
+	int sects;
+	long offset = img->hdr->adwTrackOffsets[trk];
+	struct D88_SECTOR *sec;
+	struct d88_track *t = &img->trk[trk];
+	
+	if ((offset < (long)sizeof(struct D88_HEADER)) || (offset + (long)sizeof(struct D88_SECTOR) > limit)) {
+		fprintf(stderr, "Track %d: offset 0x%.8lx out of image\n", trk, offset);
+		return -1;
+	}
+	sects = ((struct D88_SECTOR *)(img->map + offset))->wSectors;
+	if ((sects < 1) || (sects > maxSects)) {
+		fprintf(stderr, "Track %d: %d sectors\n", trk, sects);
+		return -1;
+	}
+	if (((t->sec = malloc(sizeof(*t->sec) * sects)) == NULL) || ((t->data = malloc(sizeof(*t->data) * sects)) == NULL)) {
+		perror("malloc");
+		return -1;
+	}
+	t->sects = sects;
+	for (cnt = 0; cnt < sects; cnt++) {
+		if (offset + (long)sizeof(struct D88_SECTOR) > limit) {
+			fprintf(stderr, "Track %d: sector %d header out of image\n", trk, cnt);
+			return -1;
+		}
+		sec = (struct D88_SECTOR *)(img->map + offset);
+		offset += sizeof(struct D88_SECTOR);
+		if (sec->wSectors != sects) {
+			fprintf(stderr, "Track %d: sector %d has %d sectors in track\n", trk, cnt, sec->wSectors);
+			return -1;
+		}
+		if (offset + sec->wLength > limit) {
+			fprintf(stderr, "Track %d: sector %d data out of image\n", trk, cnt);
+			return -1;
+		}
+		memcpy(&t->sec[cnt], sec, sizeof(*sec));
+		t->data[cnt] = img->map + offset;
+		offset += sec->wLength;
+	}
+	return 0;
+}
+
+int d88Open(struct d88_image *img, const char *filename, int maxSects)
+{
+	int fd;
+	int trk;
+	long limit;
+	struct stat st;
+	
+	memset(img, 0, sizeof(*img));
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(struct D88_HEADER)) {
+		fprintf(stderr, "%s: too short for D88 image\n", filename);
+		close(fd);
+		return -1;
+	}
+	img->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		perror("mmap");
+		img->map = NULL;
+		return -1;
+	}
+	img->size = st.st_size;
+	img->hdr = (struct D88_HEADER *)img->map;
+	
+	/* Sectors must lie in the disk size of the header */
+	limit = img->hdr->dwDiskSize;
+	if ((limit < (long)sizeof(struct D88_HEADER)) || (limit > img->size)) {
+		fprintf(stderr, "%s: disk size 0x%.8lx does not match file size 0x%.8lx\n", filename, limit, img->size);
+		d88Close(img);
+		return -1;
+	}
+	for (trk = 0; trk < D88_MAXTRACK; trk++) {
+		if ((img->hdr->adwTrackOffsets[trk] != 0) && (d88IndexTrack(img, trk, limit, maxSects) != 0)) {
+			fprintf(stderr, "%s: broken image\n", filename);
+			d88Close(img);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void d88Close(struct d88_image *img)
+{
+	int trk;
+	
+	for (trk = 0; trk < D88_MAXTRACK; trk++) {
+		free(img->trk[trk].sec);
+		free(img->trk[trk].data);
+	}
+	if (img->map != NULL) {
+		munmap(img->map, img->size);
+	}
+	memset(img, 0, sizeof(*img));
+}
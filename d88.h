@@ -64,3 +64,23 @@ struct __attribute__ ((__packed__)) D88_SECTOR {
 	unsigned char abReserved[5];
 	unsigned short wLength;
 };
+
+#define D88_MAXTRACK		164
+
+/* Track of a disk image indexed by d88Open */
+struct d88_track {
+	int sects;								/* 0: unformatted */
+	struct D88_SECTOR *sec;					/* Sector headers in physical order */
+	unsigned char **data;					/* Sector data in the mapped image */
+};
+
+/* Disk image mapped on memory */
+struct d88_image {
+	unsigned char *map;
+	long size;
+	struct D88_HEADER *hdr;
+	struct d88_track trk[D88_MAXTRACK];
+};
+
+int d88Open(struct d88_image *img, const char *filename, int maxSects);
+void d88Close(struct d88_image *img);
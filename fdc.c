@@ -12,6 +12,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <sys/ioctl.h>
 #include <linux/fd.h>
@@ -19,31 +22,479 @@
 
 #define FD_DEVICE	"/dev/fd0"
 #define GPL_SKIP	8
+#define BATCH_MAX	160
+#define FDC_UNITS	4
 
-int FdFdc;
+int FdFdc[FDC_UNITS] = { -1, -1, -1, -1 };
 unsigned char DataRate;
+const int DataKbps[] = { 500, 300, 250, 1000 };	/* Data rate of DRATE register */
+int RevTime = 166666;		/* usec per revolution (360rpm) */
 
-int fdcInit(void)
+struct fdc_backend *Backend = &fdcDevice;
+const char *BackendPath = FD_DEVICE;
+
+/* Command chain being queued per thread (BatchCount < 0: not queuing) */
+__thread int BatchCount = -1;
+__thread struct floppy_raw_cmd BatchCmd[BATCH_MAX];
+__thread void *BatchRes[BATCH_MAX];
+__thread int BatchResSize[BATCH_MAX];
+
+/* Command latency of the calling thread and of the whole process */
+const char *const fdcStatName[FDC_STAT_NUM] = {
+	[FDC_STAT_SEEK]       = "seek",
+	[FDC_STAT_READ_ID]    = "read_id",
+	[FDC_STAT_READ]       = "read",
+	[FDC_STAT_WRITE]      = "write",
+	[FDC_STAT_FORMAT]     = "format",
+	[FDC_STAT_VERIFY]     = "verify",
+	[FDC_STAT_READ_TRACK] = "read_track",
+	[FDC_STAT_OTHER]      = "other",
+};
+__thread struct fdc_stat LocalStat[FDC_STAT_NUM];
+struct fdc_stat TotalStat[FDC_STAT_NUM];
+pthread_mutex_t StatLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Trace being recorded (fdcTraceOpen) */
+FILE *TraceFile = NULL;
+long long TraceStart;
+pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Units opened by fdcInit or fdcOpen */
+unsigned char Opened;
+
+/* Linux floppy driver backend */
+static int fdcDevOpen(unsigned char unit, const char *path)
 {
-	int parm;
-	
-	if ((FdFdc = open(FD_DEVICE, O_ACCMODE | O_NDELAY)) < 0)	{
+	if ((FdFdc[unit & (FDC_UNITS - 1)] = open(path, O_ACCMODE | O_NDELAY)) < 0)	{
 		perror("fdcInit(open)");
 		return -1;
 	}
+	return 0;
+}
+
+static void fdcDevClose(unsigned char unit)
+{
+	close(FdFdc[unit & (FDC_UNITS - 1)]);
+	FdFdc[unit & (FDC_UNITS - 1)] = -1;
+}
+
+static int fdcDevReset(unsigned char unit)
+{
+	int parm;
 	
 	parm = FD_RESET_ALWAYS;
-	if (ioctl(FdFdc, FDRESET, &parm) < 0) {
+	if (ioctl(FdFdc[unit & (FDC_UNITS - 1)], FDRESET, &parm) < 0) {
 		perror("fdcInit(FDRESET)");
 		return -1;
 	}
+	return 0;
+}
+
+/* Driver issues SPECIFY itself from the drive parameters, so set them instead */
+static int fdcDevSpecify(unsigned char unit, struct floppy_raw_cmd *fdc)
+{
+	int kbps = DataKbps[fdc->rate & 0x03];
+	int srt = fdc->cmd[1] >> 4;
+	int hut = fdc->cmd[1] & 0x0f;
+	int hlt = fdc->cmd[2] >> 1;
+	struct floppy_drive_params prm;
+	
+	if (ioctl(FdFdc[unit & (FDC_UNITS - 1)], FDGETDRVPRM, &prm) < 0) {
+		return -1;
+	}
+	prm.srt = (16 - srt) * 1000 * 500 / kbps;
+	prm.hlt = hlt * 2 * 500 / kbps;
+	prm.hut = hut * 16 * 500 / kbps;
+	return ioctl(FdFdc[unit & (FDC_UNITS - 1)], FDSETDRVPRM, &prm);
+}
+
+static int fdcDevRawCmd(unsigned char unit, struct floppy_raw_cmd *fdc)
+{
+	if (((fdc->cmd[0] & 0x1f) == FDC_CMD_SPECIFY) && ((fdc->flags & FD_RAW_MORE) == 0)) {
+		return fdcDevSpecify(unit, fdc);
+	}
+	return ioctl(FdFdc[unit & (FDC_UNITS - 1)], FDRAWCMD, fdc);
+}
+
+static long long fdcDevClock(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fdcDevSync(long long time)
+{
+	/* Wall clock is shared by every thread */
+}
+
+static int fdcDevChanged(unsigned char unit)
+{
+	struct floppy_raw_cmd fdc;
+	
+	/* FD_DISK_CHANGED of FDPOLLDRVSTAT is sticky and set only for the block device,
+	   the driver reads the change line after every raw command and returns it in the flags */
+	memset(&fdc, 0, sizeof(fdc));
+	fdc.cmd[0] = FDC_CMD_SENSE_DRIVE;
+	fdc.cmd[1] = unit & (FDC_SEL_US1 | FDC_SEL_US0);
+	fdc.cmd_count = 2;
+	fdc.rate = DataRate;
+	if (ioctl(FdFdc[unit & (FDC_UNITS - 1)], FDRAWCMD, &fdc) < 0) {
+		perror("fdcDiskChanged(FDRAWCMD)");
+		return -1;
+	}
+	return ((fdc.flags & FD_RAW_DISK_CHANGE) != 0) ? 1 : 0;
+}
+
+static void fdcDevDelay(long long usec)
+{
+	struct timespec ts;
+	
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+struct fdc_backend fdcDevice = {
+	.name   = "device",
+	.open   = fdcDevOpen,
+	.close  = fdcDevClose,
+	.reset  = fdcDevReset,
+	.rawcmd = fdcDevRawCmd,
+	.clock  = fdcDevClock,
+	.sync   = fdcDevSync,
+	.changed = fdcDevChanged,
+	.delay  = fdcDevDelay,
+};
+
+/* Record every raw command with its reply and data, and the events of the drives */
+int fdcTraceOpen(const char *path)
+{
+	struct fdc_trace_header hdr;
+	
+	if ((TraceFile = fopen(path, "wb")) == NULL) {
+		perror("fdcTraceOpen");
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FDC_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = FDC_TRACE_VERSION;
+	hdr.revTime = RevTime;
+	if (fwrite(&hdr, sizeof(hdr), 1, TraceFile) != 1) {
+		perror("fdcTraceOpen");
+		fclose(TraceFile);
+		TraceFile = NULL;
+		return -1;
+	}
+	TraceStart = -1;
+	return 0;
+}
+
+void fdcTraceClose(void)
+{
+	if (TraceFile != NULL) {
+		fclose(TraceFile);
+		TraceFile = NULL;
+	}
+}
+
+/* Append a record, flushed at once so a trace of a hung drive can be read */
+static void fdcTraceWrite(struct fdc_trace_record *rec, struct floppy_raw_cmd *fdc)
+{
+	pthread_mutex_lock(&TraceLock);
+	if (TraceStart < 0) {
+		TraceStart = rec->time;
+	}
+	rec->time -= TraceStart;
+	if ((fwrite(rec, sizeof(*rec), 1, TraceFile) != 1)
+		|| ((fdc != NULL) && (rec->cmdCount != 0) && (fwrite(fdc->cmd, rec->cmdCount, 1, TraceFile) != 1))
+		|| ((fdc != NULL) && (rec->replyCount != 0) && (fwrite(fdc->reply, rec->replyCount, 1, TraceFile) != 1))
+		|| ((fdc != NULL) && (rec->length != 0) && (fwrite(fdc->data, rec->length, 1, TraceFile) != 1))
+		|| (fflush(TraceFile) != 0)) {
+		perror("fdcTrace");
+		fclose(TraceFile);
+		TraceFile = NULL;
+	}
+	pthread_mutex_unlock(&TraceLock);
+}
+
+static void fdcTraceEvent(int type, unsigned char unit, long long time, int result)
+{
+	struct fdc_trace_record rec;
+	
+	if (TraceFile == NULL) {
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.unit = unit;
+	rec.result = result;
+	rec.error = (result < 0) ? errno : 0;
+	rec.time = time;
+	rec.latency = fdcGetTime() - time;
+	fdcTraceWrite(&rec, NULL);
+}
+
+static void fdcTraceCommand(unsigned char unit, struct floppy_raw_cmd *fdc, long length, long long time,
+	long long latency, int result, int error)
+{
+	struct fdc_trace_record rec;
+	
+	if (TraceFile == NULL) {
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.type = FDC_TRACE_CMD;
+	rec.unit = unit;
+	rec.rate = fdc->rate;
+	rec.cmdCount = fdc->cmd_count;
+	rec.replyCount = (result < 0) ? 0 : fdc->reply_count;
+	rec.result = result;
+	rec.error = (result < 0) ? error : 0;
+	/* Bytes transferred, the backend leaves the residual count in length */
+	if (((fdc->flags & (FD_RAW_READ | FD_RAW_WRITE)) != 0) && (result >= 0)) {
+		rec.length = length - fdc->length;
+	}
+	rec.time = time;
+	rec.latency = latency;
+	fdcTraceWrite(&rec, fdc);
+}
+
+void fdcSetBackend(struct fdc_backend *backend, const char *path)
+{
+	Backend = backend;
+	BackendPath = path;
+}
+
+int fdcInit(void)
+{
+	return fdcOpen(0, BackendPath);
+}
+
+/* Open and reset another unit (e.g. /dev/fd1, or an image for the emulator) */
+int fdcOpen(unsigned char unit, const char *path)
+{
+	int ret;
+	long long time;
 	
+	if (Backend->open(unit, path) != 0) {
+		return -1;
+	}
+	Opened |= 1 << (unit & (FDC_UNITS - 1));
+	time = fdcGetTime();
+	ret = Backend->reset(unit);
+	fdcTraceEvent(FDC_TRACE_RESET, unit, time, ret);
+	if (ret != 0) {
+		return -1;
+	}
 	return 0;
 }
 
 void fdcExit(void)
 {
-	close(FdFdc);
+	int unit;
+	
+	for (unit = 0; unit < FDC_UNITS; unit++) {
+		if ((Opened & (1 << unit)) != 0) {
+			Backend->close(unit);
+		}
+	}
+	Opened = 0;
+	fdcTraceClose();
+}
+
+void fdcSetRpm(int rpm)
+{
+	RevTime = 60000000 / rpm;
+}
+
+int fdcGetRevTime(void)
+{
+	return RevTime;
+}
+
+long long fdcGetTime(void)
+{
+	return Backend->clock();
+}
+
+/* Wait on the backend clock (the emulator does not sleep) */
+void fdcDelay(long long usec)
+{
+	Backend->delay(usec);
+}
+
+/* Read disk change line of the unit, 1: the disk was changed or taken out */
+int fdcDiskChanged(unsigned char unit)
+{
+	int ret;
+	long long time = fdcGetTime();
+	
+	ret = Backend->changed(unit);
+	fdcTraceEvent(FDC_TRACE_CHANGED, unit, time, ret);
+	return ret;
+}
+
+/* Let the calling thread's clock catch up with an event of another thread */
+void fdcSyncTime(long long time)
+{
+	Backend->sync(time);
+}
+
+static int fdcStatClass(struct floppy_raw_cmd *fdc)
+{
+	switch (fdc->cmd[0] & 0x1f) {
+		case FDC_CMD_SEEK:
+		case FDC_CMD_RECALIBRATE:
+			return FDC_STAT_SEEK;
+		case FDC_CMD_READ_ID:
+			return FDC_STAT_READ_ID;
+		case FDC_CMD_READ_DATA:
+		case FDC_CMD_READ_DELETED_DATA:
+			return FDC_STAT_READ;
+		case FDC_CMD_WRITE_DATA:
+		case FDC_CMD_WRITE_DELETED_DATA:
+			return FDC_STAT_WRITE;
+		case FDC_CMD_FORMAT_TRACK:
+			return FDC_STAT_FORMAT;
+		case FDC_CMD_VERIFY:
+			return FDC_STAT_VERIFY;
+		case FDC_CMD_READ_TRACK:
+			return FDC_STAT_READ_TRACK;
+		default:
+			return FDC_STAT_OTHER;
+	}
+}
+
+static void fdcStatAdd(struct fdc_stat *st, long long latency, int error)
+{
+	int bucket = 0;
+	
+	while ((bucket < FDC_STAT_BUCKETS - 1) && (latency >= (1LL << bucket))) {
+		bucket++;
+	}
+	if ((st->count == 0) || (latency < st->min)) {
+		st->min = latency;
+	}
+	if (latency > st->max) {
+		st->max = latency;
+	}
+	st->count++;
+	st->errors += error;
+	st->total += latency;
+	st->hist[bucket]++;
+}
+
+/* Record latency of a command, abnormal end in ST0 is an error except for SENSE DRIVE (ST3) */
+static void fdcStatRecord(struct floppy_raw_cmd *fdc, long long latency, int failed)
+{
+	int class = fdcStatClass(fdc);
+	int error = failed || ((class != FDC_STAT_OTHER) && (fdc->reply_count != 0) && ((fdc->reply[0] & FDC_ST0_IC) != 0));
+	
+	fdcStatAdd(&LocalStat[class], latency, error);
+	pthread_mutex_lock(&StatLock);
+	fdcStatAdd(&TotalStat[class], latency, error);
+	pthread_mutex_unlock(&StatLock);
+}
+
+/* Copy latency statistics of the calling thread (local != 0) or of all threads */
+void fdcGetStats(struct fdc_stat *stat, int local)
+{
+	if (local != 0) {
+		memcpy(stat, LocalStat, sizeof(LocalStat));
+		return;
+	}
+	pthread_mutex_lock(&StatLock);
+	memcpy(stat, TotalStat, sizeof(TotalStat));
+	pthread_mutex_unlock(&StatLock);
+}
+
+/* Execute a raw command, or queue it while a batch is open */
+static int fdcExec(unsigned char unit, struct floppy_raw_cmd *fdc, void *res, int size, const char *name)
+{
+	int ret;
+	int error;
+	long length = fdc->length;
+	long long time;
+	long long latency;
+	
+	if (BatchCount >= 0) {
+		if (BatchCount >= BATCH_MAX) {
+			fprintf(stderr, "%s: too many commands in batch\n", name);
+			return -1;
+		}
+		fdc->flags |= FD_RAW_MORE;
+		memcpy(&BatchCmd[BatchCount], fdc, sizeof(*fdc));
+		BatchRes[BatchCount] = res;
+		BatchResSize[BatchCount] = size;
+		BatchCount++;
+		return 0;
+	}
+	
+	time = fdcGetTime();
+	ret = Backend->rawcmd(unit, fdc);
+	error = errno;
+	latency = fdcGetTime() - time;
+	fdcStatRecord(fdc, latency, ret < 0);
+	fdcTraceCommand(unit, fdc, length, time, latency, ret, error);
+	if (ret < 0) {
+		errno = error;
+		perror(name);
+		return -1;
+	}
+	
+	if (res != NULL) {
+		memcpy(res, fdc->reply, size);
+	}
+	return 0;
+}
+
+/* Start queuing commands, results are stored when fdcBatchSubmit is called */
+void fdcBatchBegin(void)
+{
+	BatchCount = 0;
+}
+
+/* Execute queued commands as one FD_RAW_MORE chain and copy each reply to its result */
+int fdcBatchSubmit(unsigned char unit)
+{
+	int cnt;
+	int ret;
+	int error;
+	int count = BatchCount;
+	long length[BATCH_MAX];
+	long long time;
+	long long latency;
+	
+	BatchCount = -1;
+	if (count <= 0) {
+		return 0;
+	}
+	BatchCmd[count - 1].flags &= ~FD_RAW_MORE;
+	for (cnt = 0; cnt < count; cnt++) {
+		length[cnt] = BatchCmd[cnt].length;
+	}
+	time = fdcGetTime();
+	ret = Backend->rawcmd(unit, BatchCmd);
+	error = errno;
+	/* One ioctl for the chain, each command gets an even share of its time */
+	latency = (fdcGetTime() - time) / count;
+	for (cnt = 0; cnt < count; cnt++) {
+		fdcStatRecord(&BatchCmd[cnt], latency, ret < 0);
+		fdcTraceCommand(unit, &BatchCmd[cnt], length[cnt], time + latency * cnt, latency, ret, error);
+	}
+	if (ret < 0) {
+		errno = error;
+		perror("fdcBatchSubmit");
+		return -1;
+	}
+	for (cnt = 0; cnt < count; cnt++) {
+		if (BatchRes[cnt] != NULL) {
+			memcpy(BatchRes[cnt], BatchCmd[cnt].reply, BatchResSize[cnt]);
+		}
+	}
+	return 0;
 }
 
 void fdcSetDataRate(unsigned char datarate)
@@ -51,6 +502,28 @@ void fdcSetDataRate(unsigned char datarate)
 	DataRate = datarate;
 }
 
+/* Step rate [usec], head load and unload time [msec], rounded to slower codes at the data rate */
+int fdcSpecify(unsigned char unit, int step, int load, int unload)
+{
+	int kbps = DataKbps[DataRate & 0x03];
+	int srt = 16 - (step * kbps / 500 + 999) / 1000;
+	int hlt = (load * kbps / 500 + 1) / 2;
+	int hut = (unload * kbps / 500 + 15) / 16;
+	struct floppy_raw_cmd fdc;
+	
+	srt = (srt < 1) ? 1 : (srt > 15) ? 15 : srt;
+	hlt = (hlt < 1) ? 1 : (hlt > 127) ? 127 : hlt;
+	hut = (hut < 1) ? 1 : (hut > 15) ? 15 : hut;
+	fdc.cmd[0] = FDC_CMD_SPECIFY;
+	fdc.cmd[1] = (srt << 4) | hut;
+	fdc.cmd[2] = hlt << 1;
+	fdc.cmd_count = 3;
+	fdc.flags = 0;
+	fdc.rate = DataRate;
+	
+	return fdcExec(unit, &fdc, NULL, 0, "fdcSpecify");
+}
+
 int fdcSenseDrive(unsigned char unit, struct fdc_res_sens *res)
 {
 	struct floppy_raw_cmd fdc;
@@ -59,14 +532,9 @@ int fdcSenseDrive(unsigned char unit, struct fdc_res_sens *res)
 	fdc.cmd[1] = unit;
 	fdc.cmd_count = 2;
 	fdc.flags = 0;
+	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcSenseDrive");
-		return -1;
-	}
-	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcSenseDrive");
 }
 
 int fdcRecalibrate(unsigned char unit, struct fdc_res_intr *res)
@@ -77,14 +545,9 @@ int fdcRecalibrate(unsigned char unit, struct fdc_res_intr *res)
 	fdc.cmd[1] = unit;
 	fdc.cmd_count = 2;
 	fdc.flags = FD_RAW_INTR;
+	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcRecalibrate");
-		return -1;
-	}
-	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcRecalibrate");
 }
 
 int fdcSeek(unsigned char unit, unsigned char cylinder, struct fdc_res_intr *res)
@@ -96,14 +559,9 @@ int fdcSeek(unsigned char unit, unsigned char cylinder, struct fdc_res_intr *res
 	fdc.cmd[2] = cylinder;
 	fdc.cmd_count = 3;
 	fdc.flags = FD_RAW_INTR;
+	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcSeek");
-		return -1;
-	}
-	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcSeek");
 }
 
 int fdcReadId(unsigned char unit, unsigned char head, unsigned char cmdopt, struct fdc_res_cmd *res)
@@ -116,13 +574,7 @@ int fdcReadId(unsigned char unit, unsigned char head, unsigned char cmdopt, stru
 	fdc.flags = FD_RAW_INTR;
 	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcReadId");
-		return -1;
-	}
-	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcReadId");
 }
 
 int fdcReadData(unsigned char unit, unsigned char head, unsigned char cmdopt,
@@ -145,13 +597,34 @@ int fdcReadData(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	fdc.length = NSECSIZE(id->n);
 	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcReadData");
-		return -1;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcReadData");
+}
+
+int fdcReadMultiData(unsigned char unit, unsigned char head, unsigned char cmdopt,
+	struct fdc_sector_id *id, unsigned char eot, int deleted, unsigned char *datPtr, struct fdc_res_cmd *res)
+{
+	struct floppy_raw_cmd fdc;
+	
+	fdc.cmd[0] = (deleted ? FDC_CMD_READ_DELETED_DATA : FDC_CMD_READ_DATA) | cmdopt;
+	fdc.cmd[1] = unit | (head << 2);
+	fdc.cmd[2] = id->c;
+	fdc.cmd[3] = id->h;
+	fdc.cmd[4] = id->r;
+	fdc.cmd[5] = id->n;
+	fdc.cmd[6] = eot;
+	fdc.cmd[7] = GPL_SKIP;
+	fdc.cmd[8] = 0xff;
+	fdc.cmd_count = 9;
+	fdc.flags = FD_RAW_INTR | FD_RAW_READ;
+	fdc.data = datPtr;
+	fdc.length = NSECSIZE(id->n) * (eot - id->r + 1);
+	if ((cmdopt & FDC_OPT_MT) != 0) {
+		/* Multi-track continues from R=1 to EOT of head 1 */
+		fdc.length += NSECSIZE(id->n) * eot;
 	}
+	fdc.rate = DataRate;
 	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcReadMultiData");
 }
 
 int fdcVerify(unsigned char unit, unsigned char head, unsigned char cmdopt,
@@ -165,20 +638,35 @@ int fdcVerify(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	fdc.cmd[3] = id->h;
 	fdc.cmd[4] = id->r;
 	fdc.cmd[5] = id->n;
-	fdc.cmd[6] = 1;
+	fdc.cmd[6] = id->r;	/* No terminal count without DMA, end at EOT */
 	fdc.cmd[7] = GPL_SKIP;
 	fdc.cmd[8] = 0xff;
 	fdc.cmd_count = 9;
 	fdc.flags = FD_RAW_INTR;
 	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcVerify");
-		return -1;
-	}
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcVerify");
+}
+
+int fdcVerifyMulti(unsigned char unit, unsigned char head, unsigned char cmdopt,
+	struct fdc_sector_id *id, unsigned char eot, struct fdc_res_cmd *res)
+{
+	struct floppy_raw_cmd fdc;
 	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	fdc.cmd[0] = FDC_CMD_VERIFY | cmdopt;
+	fdc.cmd[1] = unit | (head << 2);
+	fdc.cmd[2] = id->c;
+	fdc.cmd[3] = id->h;
+	fdc.cmd[4] = id->r;
+	fdc.cmd[5] = id->n;
+	fdc.cmd[6] = eot;
+	fdc.cmd[7] = GPL_SKIP;
+	fdc.cmd[8] = 0xff;
+	fdc.cmd_count = 9;
+	fdc.flags = FD_RAW_INTR;
+	fdc.rate = DataRate;
+	
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcVerifyMulti");
 }
 
 int fdcWriteData(unsigned char unit, unsigned char head, unsigned char cmdopt,
@@ -201,13 +689,30 @@ int fdcWriteData(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	fdc.length = NSECSIZE(id->n);
 	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcWriteData");
-		return -1;
-	}
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcWriteData");
+}
+
+int fdcWriteMultiData(unsigned char unit, unsigned char head, unsigned char cmdopt,
+	struct fdc_sector_id *id, unsigned char eot, int deleted, unsigned char *datPtr, struct fdc_res_cmd *res)
+{
+	struct floppy_raw_cmd fdc;
 	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	fdc.cmd[0] = (deleted ? FDC_CMD_WRITE_DELETED_DATA : FDC_CMD_WRITE_DATA) | cmdopt;
+	fdc.cmd[1] = unit | (head << 2);
+	fdc.cmd[2] = id->c;
+	fdc.cmd[3] = id->h;
+	fdc.cmd[4] = id->r;
+	fdc.cmd[5] = id->n;
+	fdc.cmd[6] = eot;
+	fdc.cmd[7] = GPL_SKIP;
+	fdc.cmd[8] = 0xff;
+	fdc.cmd_count = 9;
+	fdc.flags = FD_RAW_INTR | FD_RAW_WRITE;
+	fdc.data = datPtr;
+	fdc.length = NSECSIZE(id->n) * (eot - id->r + 1);
+	fdc.rate = DataRate;
+	
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcWriteMultiData");
 }
 
 int fdcFormat(unsigned char unit, unsigned char head, unsigned char cmdopt,
@@ -228,17 +733,11 @@ int fdcFormat(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	fdc.length = countR * 4; /* C H R N */
 	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcFormat");
-		return -1;
-	}
-	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcFormat");
 }
 
 int fdcReadDiag(unsigned char unit, unsigned char head, unsigned char cmdopt,
-	struct fdc_sector_id *id, unsigned char sizeN, unsigned char *datPtr, struct fdc_res_cmd *res)
+	struct fdc_sector_id *id, int length, unsigned char *datPtr, struct fdc_res_cmd *res)
 {
 	struct floppy_raw_cmd fdc;
 	
@@ -254,14 +753,8 @@ int fdcReadDiag(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	fdc.cmd_count = 9;
 	fdc.flags = FD_RAW_INTR | FD_RAW_READ;
 	fdc.data = datPtr;
-	fdc.length = NSECSIZE(sizeN);
+	fdc.length = length;	/* Terminal count ends the transfer */
 	fdc.rate = DataRate;
 	
-	if (ioctl(FdFdc, FDRAWCMD, &fdc) < 0) {
-		perror("fdcReadDiag");
-		return -1;
-	}
-	
-	memcpy(res, fdc.reply, sizeof(*res));
-	return 0;
+	return fdcExec(unit, &fdc, res, sizeof(*res), "fdcReadDiag");
 }
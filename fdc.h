@@ -103,10 +103,106 @@ struct __attribute__ ((__packed__)) fdc_sector_id {
 	unsigned char n;
 };
 
+/* Latency statistics of each command class */
+enum {
+	FDC_STAT_SEEK = 0,		/* SEEK, RECALIBRATE */
+	FDC_STAT_READ_ID,
+	FDC_STAT_READ,			/* READ DATA, READ DELETED DATA */
+	FDC_STAT_WRITE,			/* WRITE DATA, WRITE DELETED DATA */
+	FDC_STAT_FORMAT,
+	FDC_STAT_VERIFY,
+	FDC_STAT_READ_TRACK,
+	FDC_STAT_OTHER,			/* SENSE DRIVE, SPECIFY */
+	FDC_STAT_NUM
+};
+
+#define FDC_STAT_BUCKETS	25		/* Histogram bucket n counts latency below 2^n usec */
+
+struct fdc_stat {
+	long long count;
+	long long errors;		/* Command failed or ended abnormally */
+	long long total;		/* Latency [usec] */
+	long long min;
+	long long max;
+	long long hist[FDC_STAT_BUCKETS];
+};
+
+extern const char *const fdcStatName[FDC_STAT_NUM];
+
+/* Trace of raw commands, a header followed by records with their variable part
+   (command bytes, reply bytes and data of a read or write) */
+#define FDC_TRACE_MAGIC		"FDMTRACE"
+#define FDC_TRACE_VERSION	1
+
+enum {
+	FDC_TRACE_CMD = 1,		/* Raw command */
+	FDC_TRACE_RESET,		/* Controller reset */
+	FDC_TRACE_CHANGED		/* Disk change line polled, result is the line or -1 */
+};
+
+struct __attribute__ ((__packed__)) fdc_trace_header {
+	char magic[8];
+	unsigned short version;
+	unsigned short reserved;
+	unsigned int revTime;	/* usec per revolution when recorded */
+};
+
+struct __attribute__ ((__packed__)) fdc_trace_record {
+	unsigned char type;
+	unsigned char unit;
+	unsigned char rate;
+	unsigned char cmdCount;
+	unsigned char replyCount;
+	unsigned char reserved;
+	short result;			/* Return value of the backend */
+	int error;				/* errno when failed */
+	unsigned int length;	/* Data bytes transferred */
+	long long time;			/* Start from the beginning of the trace [usec] */
+	long long latency;		/* [usec], commands of a chain share the time of the chain */
+};
+
+/* FDC backend (executes floppy_raw_cmd on behalf of the command functions) */
+struct floppy_raw_cmd;
+
+struct fdc_backend {
+	const char *name;
+	int (*open)(unsigned char unit, const char *path);
+	void (*close)(unsigned char unit);
+	int (*reset)(unsigned char unit);
+	int (*rawcmd)(unsigned char unit, struct floppy_raw_cmd *cmd);
+	long long (*clock)(void);	/* Monotonic time in usec */
+	void (*sync)(long long time);	/* Advance the clock of the calling thread to time */
+	int (*changed)(unsigned char unit);	/* Disk change line, 1: changed or no disk */
+	void (*delay)(long long usec);
+};
+
+extern struct fdc_backend fdcDevice;	/* Linux floppy driver (FDRAWCMD) */
+extern struct fdc_backend fdcEmulator;	/* uPD765 emulator serving a D88 image */
+extern struct fdc_backend fdcReplay;	/* Replies of a recorded trace */
+
+void fdcSetBackend(struct fdc_backend *backend, const char *path);
+void fdcSetRpm(int rpm);
+int fdcGetRevTime(void);
+long long fdcGetTime(void);
+void fdcSyncTime(long long time);
+void fdcDelay(long long usec);
+int fdcDiskChanged(unsigned char unit);
+
 int fdcInit(void);
+int fdcOpen(unsigned char unit, const char *path);
 void fdcExit(void);
 void fdcSetDataRate(unsigned char drate);
 
+void fdcGetStats(struct fdc_stat *stat, int local);
+int fdcTraceOpen(const char *path);
+void fdcTraceClose(void);
+
+/* Command batch: commands issued between these calls are sent as one chain,
+   results and data buffers must stay valid until fdcBatchSubmit returns */
+void fdcBatchBegin(void);
+int fdcBatchSubmit(unsigned char unit);
+
+int fdcSpecify(unsigned char unit, int step, int load, int unload);
 int fdcSenseDrive(unsigned char unit, struct fdc_res_sens *res);
 int fdcRecalibrate(unsigned char unit, struct fdc_res_intr *res);
 int fdcSeek(unsigned char unit, unsigned char cylinder, struct fdc_res_intr *res);
@@ -114,12 +210,18 @@ int fdcReadId(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	struct fdc_res_cmd *res);
 int fdcReadData(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	struct fdc_sector_id *id, int deleted, unsigned char *datBuf, struct fdc_res_cmd *res);
+int fdcReadMultiData(unsigned char unit, unsigned char head, unsigned char cmdopt,
+	struct fdc_sector_id *id, unsigned char eot, int deleted, unsigned char *datBuf, struct fdc_res_cmd *res);
 int fdcVerify(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	struct fdc_sector_id *id, struct fdc_res_cmd *res);
+int fdcVerifyMulti(unsigned char unit, unsigned char head, unsigned char cmdopt,
+	struct fdc_sector_id *id, unsigned char eot, struct fdc_res_cmd *res);
 int fdcWriteData(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	struct fdc_sector_id *id, int deleted, unsigned char *datBuf, struct fdc_res_cmd *res);
+int fdcWriteMultiData(unsigned char unit, unsigned char head, unsigned char cmdopt,
+	struct fdc_sector_id *id, unsigned char eot, int deleted, unsigned char *datBuf, struct fdc_res_cmd *res);
 int fdcFormat(unsigned char unit, unsigned char head, unsigned char cmdopt,
 	unsigned char sizeN, unsigned char countR, unsigned char formatGpl, unsigned char dataPtn,
 	struct fdc_sector_id *idBuf, struct fdc_res_cmd *res);
 int fdcReadDiag(unsigned char unit, unsigned char head, unsigned char cmdopt,
-	struct fdc_sector_id *id, unsigned char sizeN, unsigned char *datBuf, struct fdc_res_cmd *res);
\ No newline at end of file
+	struct fdc_sector_id *id, int length, unsigned char *datBuf, struct fdc_res_cmd *res);
\ No newline at end of file
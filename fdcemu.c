@@ -0,0 +1,1027 @@
+/*
+ * Implementation for emulated FDC (uPD765) serving a D88 disk image
+ *
+ * Copyright (c) 2021 stzlab
+ *
+ * This software is released under the MIT License, see LICENSE.
+ */
+
+#include "fdc.h"
+#include "d88.h"
+#include "trk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/fd.h>
+
+#define EMU_UNITS		4
+#define EMU_MAXTRK		164
+#define EMU_MAXCYL		84			/* Last cylinder of the emulated drive */
+#define EMU_MAXSECT		256
+
+/* Timing of the emulated drive [nsec] */
+#define EMU_LATENCY		5000000LL	/* Command overhead (ioctl, command and result phase) */
+#define EMU_CHAIN		300000LL	/* Chained command (FD_RAW_MORE), only command and result phase */
+#define EMU_SPINUP		500000000LL	/* Motor spin up */
+#define EMU_RESET		20000000LL	/* Controller reset */
+#define EMU_STEP		4000000LL	/* Step rate time until SPECIFY */
+#define EMU_SETTLE		15000000LL	/* Head load time until SPECIFY */
+#define EMU_MINSTEP		2000000LL	/* Step pulses faster than this are lost by the mechanism */
+#define EMU_MINSETTLE	10000000LL	/* Head vibrates after the last step, IDs read with CRC error */
+#define EMU_RECALSTEP	77			/* Step pulses of RECALIBRATE before giving up */
+#define EMU_SWAP		8000000000LL	/* Operator takes out the disk and inserts the next one */
+
+#define EMU_READ		0
+#define EMU_WRITE		1
+#define EMU_VERIFY		2
+
+struct emu_sector {
+	struct fdc_sector_id id;
+	unsigned char enc;
+	unsigned char dam;
+	unsigned char status;
+	unsigned char reserved[5];
+	int length;
+	unsigned char *data;
+	long long idPos;			/* Start of ID field from index [nsec] */
+	long long idEnd;			/* End of ID field */
+	long long dataPos;			/* Start of data field */
+	long long dataEnd;			/* End of data field */
+};
+
+struct emu_track {
+	int rate;					/* Data rate written with [kbps] (0:unformatted) */
+	int sects;
+	struct emu_sector *sec;		/* Sectors in physical order */
+};
+
+struct emu_drive {
+	char path[1024];
+	char queue[1024];			/* Images inserted next, separated by comma */
+	int loaded;
+	int changed;				/* Disk change line, reset by a step with the disk inserted */
+	int used;					/* Media was accessed since inserted */
+	long long ejected;			/* Time the disk was taken out */
+	int blank;
+	int modified;
+	int sides;
+	int step;					/* Shift from physical to media cylinder */
+	int pcn;					/* Present cylinder number the FDC counted */
+	int cyl;					/* Cylinder the head actually is on */
+	long long stepTime;			/* SRT and HLT of the last SPECIFY [nsec] */
+	long long loadTime;
+	long long settled;			/* Time the head stops vibrating after a seek */
+	int motor;
+	struct D88_HEADER hdr;
+	struct emu_track trk[EMU_MAXTRK];
+};
+
+static struct emu_drive EmuDrive[EMU_UNITS];
+static __thread long long EmuNow;	/* Simulated time of the calling thread [nsec] */
+
+static long long emuPeriod(void)
+{
+	return (long long)fdcGetRevTime() * 1000;
+}
+
+static int emuRateKbps(unsigned char rate)
+{
+	static const int kbps[] = { 500, 300, 250, 1000 };
+
+	return kbps[rate & 0x03];
+}
+
+static int emuMediaRate(struct emu_drive *drv)
+{
+	if (drv->hdr.bMediaType == D88_TYPE_2HD) {
+		return 500;
+	}
+	return (fdcGetRevTime() > 180000) ? 250 : 300;
+}
+
+static long long emuByteTime(int kbps, int enc)
+{
+	return ((enc == D88_ENCODE_FM) ? 16000000LL : 8000000LL) / kbps;
+}
+
+/* Place ID and data fields on the track, gap3 < 0 spreads sectors over the whole track */
+static void emuLayoutTrack(struct emu_track *trk, int gap3)
+{
+	int cnt;
+	int mfm;
+	long long bt;
+	long long pos;
+	long long used;
+	long long gap;
+	long long period = emuPeriod();
+	struct emu_sector *sec;
+
+	if (trk->sects == 0) {
+		return;
+	}
+	mfm = (trk->sec[0].enc == D88_ENCODE_MFM);
+	bt = emuByteTime(trk->rate, trk->sec[0].enc);
+	/* GAP4a, SYNC, IAM, GAP1 */
+	pos = (mfm ? 146 : 73) * bt;
+	if (gap3 < 0) {
+		used = pos;
+		for (cnt = 0; cnt < trk->sects; cnt++) {
+			sec = &trk->sec[cnt];
+			used += ((sec->enc == D88_ENCODE_MFM ? 62 : 33) + sec->length) * emuByteTime(trk->rate, sec->enc);
+		}
+		gap = (period - used) / trk->sects;
+		if (gap < bt) {
+			gap = bt;
+		}
+	} else {
+		gap = gap3 * bt;
+	}
+	for (cnt = 0; cnt < trk->sects; cnt++) {
+		sec = &trk->sec[cnt];
+		mfm = (sec->enc == D88_ENCODE_MFM);
+		bt = emuByteTime(trk->rate, sec->enc);
+		sec->idPos = pos;
+		sec->idEnd = pos + (mfm ? 22 : 13) * bt;
+		sec->dataPos = sec->idEnd + (mfm ? 22 : 11) * bt;
+		sec->dataEnd = sec->dataPos + ((mfm ? 18 : 9) + sec->length) * bt;
+		pos = sec->dataEnd + gap;
+	}
+	/* Oversized track image (copy protection), squeeze fields into one revolution */
+	if ((gap3 < 0) && (sec->dataEnd >= period)) {
+		pos = sec->dataEnd + bt;
+		for (cnt = 0; cnt < trk->sects; cnt++) {
+			sec = &trk->sec[cnt];
+			sec->idPos = sec->idPos * (period - 1) / pos;
+			sec->idEnd = sec->idEnd * (period - 1) / pos;
+			sec->dataPos = sec->dataPos * (period - 1) / pos;
+			sec->dataEnd = sec->dataEnd * (period - 1) / pos;
+		}
+	}
+}
+
+static void emuFreeTrack(struct emu_track *trk)
+{
+	int cnt;
+
+	for (cnt = 0; cnt < trk->sects; cnt++) {
+		free(trk->sec[cnt].data);
+	}
+	free(trk->sec);
+	memset(trk, 0, sizeof(*trk));
+}
+
+static struct emu_track *emuSelectTrack(struct emu_drive *drv, int head)
+{
+	int idx;
+
+	idx = drv->cyl >> drv->step;
+	if (drv->sides == 2) {
+		idx = idx * 2 + head;
+	} else if (head != 0) {
+		return NULL;
+	}
+	return (idx < EMU_MAXTRK) ? &drv->trk[idx] : NULL;
+}
+
+static int emuLoadImage(struct emu_drive *drv, const char *path)
+{
+	int trk;
+	int cnt;
+	int failed = 0;
+	long size;
+	long offset;
+	unsigned char *buf;
+	FILE *fp;
+	struct D88_SECTOR *d88;
+	struct emu_track *t;
+	struct emu_sector *sec;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		if (errno != ENOENT) {
+			perror("fdcEmulator(fopen)");
+			return -1;
+		}
+		/* Unformatted media, image is created on exit */
+		drv->blank = 1;
+		drv->hdr.bMediaType = D88_TYPE_2HD;
+		drv->sides = 2;
+		return 0;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if ((size < (long)sizeof(struct D88_HEADER)) || ((buf = malloc(size)) == NULL)) {
+		fprintf(stderr, "fdcEmulator: invalid image %s\n", path);
+		fclose(fp);
+		return -1;
+	}
+	if (fread(buf, size, 1, fp) != 1) {
+		perror("fdcEmulator(fread)");
+		free(buf);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	memcpy(&drv->hdr, buf, sizeof(drv->hdr));
+	switch (drv->hdr.bMediaType) {
+		case D88_TYPE_1D:
+			drv->step = 1;
+		case D88_TYPE_1DD:
+			drv->sides = 1;
+			break;
+		case D88_TYPE_2D:
+			drv->step = 1;
+		default:
+			drv->sides = 2;
+			break;
+	}
+	for (trk = 0; trk < EMU_MAXTRK; trk++) {
+		offset = drv->hdr.adwTrackOffsets[trk];
+		if ((offset == 0) || (offset + (long)sizeof(struct D88_SECTOR) > size)) {
+			continue;
+		}
+		t = &drv->trk[trk];
+		d88 = (struct D88_SECTOR *)(buf + offset);
+		t->rate = emuMediaRate(drv);
+		t->sects = d88->wSectors;
+		if ((t->sects != 0) && ((t->sec = calloc(t->sects, sizeof(struct emu_sector))) == NULL)) {
+			t->sects = 0;
+			failed = 1;
+			break;
+		}
+		/* Sectors cut by the end of the image are dropped, header first as it gives the data length */
+		for (cnt = 0; cnt < t->sects; cnt++) {
+			if (offset + (long)sizeof(*d88) > size) {
+				break;
+			}
+			d88 = (struct D88_SECTOR *)(buf + offset);
+			if (offset + (long)sizeof(*d88) + d88->wLength > size) {
+				break;
+			}
+			sec = &t->sec[cnt];
+			if ((sec->data = malloc(d88->wLength + 1)) == NULL) {
+				failed = 1;
+				break;
+			}
+			memcpy(&sec->id, &d88->c, sizeof(sec->id));
+			sec->enc = d88->bEncoding;
+			sec->dam = d88->bDataAddressMark;
+			sec->status = d88->bStatus;
+			memcpy(sec->reserved, d88->abReserved, sizeof(sec->reserved));
+			sec->length = d88->wLength;
+			memcpy(sec->data, buf + offset + sizeof(*d88), sec->length);
+			offset += sizeof(*d88) + d88->wLength;
+		}
+		t->sects = cnt;
+		if (failed) {
+			break;
+		}
+		emuLayoutTrack(t, -1);
+	}
+	free(buf);
+	if (failed) {
+		perror("fdcEmulator(malloc)");
+		for (trk = 0; trk < EMU_MAXTRK; trk++) {
+			emuFreeTrack(&drv->trk[trk]);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static int emuSaveImage(struct emu_drive *drv)
+{
+	int trk;
+	int cnt;
+	unsigned int offset;
+	FILE *fo;
+	struct emu_track *t;
+	struct emu_sector *sec;
+	struct D88_SECTOR d88;
+
+	if (drv->blank) {
+		drv->hdr.bMediaType = D88_TYPE_2DD;
+		for (trk = 0; trk < EMU_MAXTRK; trk++) {
+			if (drv->trk[trk].rate == 500) {
+				drv->hdr.bMediaType = D88_TYPE_2HD;
+			}
+		}
+	}
+	offset = sizeof(drv->hdr);
+	for (trk = 0; trk < EMU_MAXTRK; trk++) {
+		t = &drv->trk[trk];
+		drv->hdr.adwTrackOffsets[trk] = (t->sects != 0) ? offset : 0;
+		for (cnt = 0; cnt < t->sects; cnt++) {
+			offset += sizeof(d88) + t->sec[cnt].length;
+		}
+	}
+	drv->hdr.dwDiskSize = offset;
+
+	if ((fo = fopen(drv->path, "wb")) == NULL) {
+		perror("fdcEmulator(fopen)");
+		return -1;
+	}
+	fwrite(&drv->hdr, sizeof(drv->hdr), 1, fo);
+	for (trk = 0; trk < EMU_MAXTRK; trk++) {
+		t = &drv->trk[trk];
+		for (cnt = 0; cnt < t->sects; cnt++) {
+			sec = &t->sec[cnt];
+			memset(&d88, 0, sizeof(d88));
+			memcpy(&d88.c, &sec->id, sizeof(sec->id));
+			d88.wSectors = t->sects;
+			d88.bEncoding = sec->enc;
+			d88.bDataAddressMark = sec->dam;
+			d88.bStatus = sec->status;
+			memcpy(d88.abReserved, sec->reserved, sizeof(d88.abReserved));
+			d88.wLength = sec->length;
+			fwrite(&d88, sizeof(d88), 1, fo);
+			fwrite(sec->data, sec->length, 1, fo);
+		}
+	}
+	if (fclose(fo) != 0) {
+		perror("fdcEmulator(fclose)");
+		return -1;
+	}
+	return 0;
+}
+
+/* Time of the second index pulse from now, the uPD765 gives up searching there */
+static long long emuIndexTimeout(void)
+{
+	return EmuNow - (EmuNow % emuPeriod()) + 2 * emuPeriod();
+}
+
+/* Wait for the next ID field readable with the data rate and encoding */
+static struct emu_sector *emuNextId(struct emu_track *trk, int kbps, int enc, long long deadline)
+{
+	int rev;
+	int cnt;
+	long long period = emuPeriod();
+	long long base = EmuNow - (EmuNow % period);
+	long long pos;
+	struct emu_sector *sec;
+
+	if ((trk != NULL) && (trk->rate == kbps)) {
+		for (rev = 0; rev < 3; rev++) {
+			for (cnt = 0; cnt < trk->sects; cnt++) {
+				sec = &trk->sec[cnt];
+				pos = base + rev * period + sec->idPos;
+				if ((pos < EmuNow) || (sec->enc != enc) || (sec->status == D88_STATUS_MA)) {
+					continue;
+				}
+				if (pos > deadline) {
+					break;
+				}
+				EmuNow = pos + (sec->idEnd - sec->idPos);
+				return sec;
+			}
+		}
+	}
+	EmuNow = deadline;
+	return NULL;
+}
+
+static void emuSetReply(struct floppy_raw_cmd *cmd, unsigned char st0, unsigned char st1, unsigned char st2,
+	unsigned char c, unsigned char h, unsigned char r, unsigned char n)
+{
+	cmd->reply[0] = st0 | (cmd->cmd[1] & (FDC_SEL_HS | FDC_SEL_US1 | FDC_SEL_US0));
+	cmd->reply[1] = st1;
+	cmd->reply[2] = st2;
+	cmd->reply[3] = c;
+	cmd->reply[4] = h;
+	cmd->reply[5] = r;
+	cmd->reply[6] = n;
+	cmd->reply_count = 7;
+}
+
+static int emuReadId(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	int head = (cmd->cmd[1] >> 2) & 1;
+	int enc = (cmd->cmd[0] & FDC_OPT_MFM) ? D88_ENCODE_MFM : D88_ENCODE_FM;
+	struct emu_sector *sec;
+
+	sec = emuNextId(emuSelectTrack(drv, head), emuRateKbps(cmd->rate), enc, emuIndexTimeout());
+	if (sec == NULL) {
+		emuSetReply(cmd, 0x40, FDC_ST1_MA, 0, 0, 0, 0, 0);
+	} else if ((sec->status == D88_STATUS_DE) || (EmuNow < drv->settled)) {
+		emuSetReply(cmd, 0x40, FDC_ST1_DE, 0, sec->id.c, sec->id.h, sec->id.r, sec->id.n);
+	} else {
+		emuSetReply(cmd, 0x00, 0, 0, sec->id.c, sec->id.h, sec->id.r, sec->id.n);
+	}
+	return 0;
+}
+
+/* READ DATA / READ DELETED DATA / WRITE DATA / WRITE DELETED DATA / VERIFY */
+static int emuTransfer(struct emu_drive *drv, struct floppy_raw_cmd *cmd, int mode)
+{
+	int op = cmd->cmd[0] & 0x1f;
+	int mt = (cmd->cmd[0] & FDC_OPT_MT) != 0;
+	int sk = (cmd->cmd[0] & FDC_OPT_SK) != 0;
+	int enc = (cmd->cmd[0] & FDC_OPT_MFM) ? D88_ENCODE_MFM : D88_ENCODE_FM;
+	int deleted = (op == FDC_CMD_READ_DELETED_DATA) || (op == FDC_CMD_WRITE_DELETED_DATA);
+	int head = (cmd->cmd[1] >> 2) & 1;
+	int kbps = emuRateKbps(cmd->rate);
+	int size;
+	int copy;
+	int seen;
+	long remain = cmd->length;
+	long long deadline;
+	unsigned char *ptr = cmd->data;
+	unsigned char st0 = 0, st1 = 0, st2 = 0;
+	unsigned char c = cmd->cmd[2], h = cmd->cmd[3], r = cmd->cmd[4], n = cmd->cmd[5];
+	unsigned char eot = cmd->cmd[6];
+	struct emu_track *trk;
+	struct emu_sector *sec;
+
+	if ((mode == EMU_WRITE) && (drv->hdr.bWriteProtect != D88_PROTECT_OFF)) {
+		emuSetReply(cmd, 0x40, FDC_ST1_NW, 0, c, h, r, n);
+		return 0;
+	}
+	size = (n != 0) ? NSECSIZE(n) : ((cmd->cmd[8] < 128) ? cmd->cmd[8] : 128);
+	for (;;) {
+		/* Search sector ID */
+		trk = emuSelectTrack(drv, head);
+		deadline = emuIndexTimeout();
+		seen = 0;
+		while ((sec = emuNextId(trk, kbps, enc, deadline)) != NULL) {
+			seen = 1;
+			if (EmuNow < drv->settled) {
+				break;
+			}
+			if ((sec->id.c != c) && (sec->id.c != 0xff)) {
+				st2 |= FDC_ST2_WC;
+			} else if ((sec->id.c == 0xff) && (c != 0xff)) {
+				st2 |= FDC_ST2_BC;
+			}
+			if (memcmp(&sec->id, &(struct fdc_sector_id){ c, h, r, n }, sizeof(sec->id)) == 0) {
+				break;
+			}
+		}
+		if (sec == NULL) {
+			st0 = 0x40;
+			st1 |= seen ? FDC_ST1_ND : FDC_ST1_MA;
+			break;
+		}
+		st2 &= ~(FDC_ST2_WC | FDC_ST2_BC);
+		if ((sec->status == D88_STATUS_DE) || (EmuNow < drv->settled)) {
+			st0 = 0x40;
+			st1 |= FDC_ST1_DE;
+			break;
+		}
+		if (sec->status == D88_STATUS_MD) {
+			st0 = 0x40;
+			st1 |= FDC_ST1_MA;
+			st2 |= FDC_ST2_MD;
+			break;
+		}
+		/* Transfer data field */
+		EmuNow += sec->dataEnd - sec->idEnd;
+		if (mode == EMU_WRITE) {
+			if (sec->length < size) {
+				sec->data = realloc(sec->data, size);
+				sec->length = size;
+			}
+			copy = (remain < size) ? remain : size;
+			memcpy(sec->data, ptr, copy);
+			ptr += copy;
+			remain -= copy;
+			sec->dam = deleted ? D88_DAM_DELETED : D88_DAM_NORMAL;
+			sec->status = 0;
+			drv->modified = 1;
+		} else {
+			if ((sec->dam == D88_DAM_DELETED) != deleted) {
+				if (sk) {
+					goto next;
+				}
+				st2 |= FDC_ST2_CM;
+			}
+			if (mode == EMU_READ) {
+				copy = (remain < size) ? remain : size;
+				memset(ptr, 0, copy);
+				memcpy(ptr, sec->data, (copy < sec->length) ? copy : sec->length);
+				ptr += copy;
+				remain -= copy;
+			}
+			if (sec->status == D88_STATUS_DD) {
+				st0 = 0x40;
+				st1 |= FDC_ST1_DE;
+				st2 |= FDC_ST2_DD;
+				break;
+			}
+			if ((st2 & FDC_ST2_CM) != 0) {
+				break;
+			}
+		}
+		/* Terminal count */
+		if ((mode != EMU_VERIFY) && (remain <= 0)) {
+			break;
+		}
+next:
+		if (r == eot) {
+			if (mt && (head == 0)) {
+				head = 1;
+				h ^= 1;
+				r = 1;
+				cmd->cmd[1] |= FDC_SEL_HS;
+				continue;
+			}
+			if (mode != EMU_VERIFY) {
+				st0 = 0x40;
+				st1 |= FDC_ST1_EN;
+			}
+			break;
+		}
+		r++;
+	}
+	cmd->length = remain;
+	/* Result ID points the next sector, or the sector terminated the command */
+	if ((st0 != 0) || ((st2 & FDC_ST2_CM) != 0)) {
+		emuSetReply(cmd, st0, st1, st2, c, h, r, n);
+	} else if (r == eot) {
+		emuSetReply(cmd, st0, st1, st2, c + 1, h, 1, n);
+	} else {
+		emuSetReply(cmd, st0, st1, st2, c, h, r + 1, n);
+	}
+	return 0;
+}
+
+/* Put bytes on the raw track, wrapping around the index */
+static void emuPutRaw(unsigned char *raw, long len, long pos, const unsigned char *buf, int num)
+{
+	while (num-- > 0) {
+		raw[pos++ % len] = *buf++;
+	}
+}
+
+/* Put an address mark field with sync and CRC, bad CRC on error */
+static void emuPutField(unsigned char *raw, long len, long pos, int mfm, unsigned char mark,
+	const unsigned char *buf, int num, int error)
+{
+	unsigned char sync[16];
+	unsigned char crc[2];
+	unsigned short val;
+	int head = mfm ? 16 : 7;
+
+	memset(sync, 0x00, sizeof(sync));
+	if (mfm) {
+		memset(&sync[12], 0xa1, 3);
+	}
+	sync[head - 1] = mark;
+	val = trkCrc(0xffff, &sync[mfm ? 12 : 6], mfm ? 4 : 1);
+	val = trkCrc(val, buf, num) ^ (error ? 0xffff : 0);
+	crc[0] = val >> 8;
+	crc[1] = val & 0xff;
+	emuPutRaw(raw, len, pos, sync, head);
+	emuPutRaw(raw, len, pos + head, buf, num);
+	emuPutRaw(raw, len, pos + head + num, crc, 2);
+}
+
+/* Render one revolution of decoded bytes readable with the encoding */
+static unsigned char *emuRenderTrack(struct emu_track *trk, int enc, long long bt, long len)
+{
+	int cnt;
+	int size;
+	int mfm = (enc == D88_ENCODE_MFM);
+	unsigned char *raw;
+	unsigned char *data;
+	struct emu_sector *sec;
+
+	if ((raw = malloc(len)) == NULL) {
+		return NULL;
+	}
+	memset(raw, mfm ? 0x4e : 0xff, len);
+	for (cnt = 0; cnt < trk->sects; cnt++) {
+		sec = &trk->sec[cnt];
+		if (sec->enc != enc) {
+			continue;
+		}
+		if (sec->status != D88_STATUS_MA) {
+			emuPutField(raw, len, sec->idPos / bt, mfm, 0xfe, (unsigned char *)&sec->id, 4, sec->status == D88_STATUS_DE);
+		}
+		if (sec->status != D88_STATUS_MD) {
+			/* Data field as READ DATA transfers it, size of N */
+			size = NSECSIZE(sec->id.n);
+			if ((data = calloc(1, size)) == NULL) {
+				free(raw);
+				return NULL;
+			}
+			memcpy(data, sec->data, (sec->length < size) ? sec->length : size);
+			emuPutField(raw, len, sec->dataPos / bt, mfm, (sec->dam == D88_DAM_DELETED) ? 0xf8 : 0xfb,
+				data, size, sec->status == D88_STATUS_DD);
+			free(data);
+		}
+	}
+	return raw;
+}
+
+/* READ TRACK, data fields from the index are transferred continuously as sectors of N */
+static int emuReadTrack(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	int cnt;
+	int idx;
+	int num = 0;
+	int size;
+	int copy;
+	int head = (cmd->cmd[1] >> 2) & 1;
+	int enc = (cmd->cmd[0] & FDC_OPT_MFM) ? D88_ENCODE_MFM : D88_ENCODE_FM;
+	int kbps = emuRateKbps(cmd->rate);
+	long len;
+	long pos;
+	long remain = cmd->length;
+	long long bt = emuByteTime(kbps, enc);
+	long long period = emuPeriod();
+	long long base = EmuNow - (EmuNow % period) + period;
+	unsigned char *ptr = cmd->data;
+	unsigned char *raw;
+	unsigned char st1 = 0, st2 = 0;
+	unsigned char n = cmd->cmd[5], eot = cmd->cmd[6];
+	struct emu_track *trk = emuSelectTrack(drv, head);
+	struct emu_sector *list[EMU_MAXSECT];
+
+	/* Sectors with ID and data field in physical order */
+	if ((trk != NULL) && (trk->rate == kbps)) {
+		for (cnt = 0; (cnt < trk->sects) && (num < EMU_MAXSECT); cnt++) {
+			if ((trk->sec[cnt].enc == enc) && (trk->sec[cnt].status != D88_STATUS_MA) && (trk->sec[cnt].status != D88_STATUS_MD)) {
+				list[num++] = &trk->sec[cnt];
+			}
+		}
+	}
+	if (num == 0) {
+		EmuNow = base + period;
+		emuSetReply(cmd, 0x40, FDC_ST1_MA, 0, cmd->cmd[2], cmd->cmd[3], cmd->cmd[4], n);
+		return 0;
+	}
+	len = period / bt;
+	if ((raw = emuRenderTrack(trk, enc, bt, len)) == NULL) {
+		return -1;
+	}
+	size = NSECSIZE(n);
+	for (cnt = 0; (cnt < eot) && (remain > 0); cnt++) {
+		idx = cnt % num;
+		if (memcmp(&list[idx]->id, &cmd->cmd[2], sizeof(list[idx]->id)) != 0) {
+			st1 |= FDC_ST1_ND;
+		}
+		/* Sector of other size reads on beyond its data field, CRC does not match */
+		if ((size != NSECSIZE(list[idx]->id.n)) || (list[idx]->status == D88_STATUS_DD)) {
+			st1 |= FDC_ST1_DE;
+			st2 |= FDC_ST2_DD;
+		}
+		pos = list[idx]->dataPos / bt + ((enc == D88_ENCODE_MFM) ? 16 : 7);
+		copy = (remain < size) ? remain : size;
+		for (; copy > 0; copy--, remain--) {
+			*ptr++ = raw[pos++ % len];
+		}
+		EmuNow = base + (cnt / num) * period + pos * bt;
+	}
+	free(raw);
+	cmd->length = remain;
+	if (remain > 0) {
+		st1 |= FDC_ST1_EN;
+	}
+	emuSetReply(cmd, ((st1 | st2) != 0) ? 0x40 : 0x00, st1, st2, cmd->cmd[2], cmd->cmd[3], cmd->cmd[4], n);
+	return 0;
+}
+
+static int emuFormat(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	int cnt;
+	int head = (cmd->cmd[1] >> 2) & 1;
+	int n = cmd->cmd[2];
+	int sects = cmd->cmd[3];
+	long long period = emuPeriod();
+	long long over;
+	struct fdc_sector_id *id = cmd->data;
+	struct emu_track *trk;
+	struct emu_sector *sec;
+
+	if (drv->hdr.bWriteProtect != D88_PROTECT_OFF) {
+		emuSetReply(cmd, 0x40, FDC_ST1_NW, 0, 0, 0, 0, 0);
+		return 0;
+	}
+	if ((trk = emuSelectTrack(drv, head)) == NULL) {
+		emuSetReply(cmd, 0x40 | FDC_ST0_NR, 0, 0, 0, 0, 0, 0);
+		return 0;
+	}
+	/* Wait index and write one revolution */
+	EmuNow += period - (EmuNow % period) + period;
+
+	emuFreeTrack(trk);
+	trk->rate = emuRateKbps(cmd->rate);
+	trk->sects = sects;
+	trk->sec = calloc(sects, sizeof(struct emu_sector));
+	for (cnt = 0; cnt < sects; cnt++) {
+		sec = &trk->sec[cnt];
+		memcpy(&sec->id, &id[cnt], sizeof(sec->id));
+		sec->enc = (cmd->cmd[0] & FDC_OPT_MFM) ? D88_ENCODE_MFM : D88_ENCODE_FM;
+		sec->dam = D88_DAM_NORMAL;
+		sec->length = NSECSIZE(n);
+		sec->data = malloc(sec->length);
+		memset(sec->data, cmd->cmd[5], sec->length);
+	}
+	emuLayoutTrack(trk, cmd->cmd[4]);
+	/* Writing beyond the index overwrites the beginning of the track */
+	over = (sects != 0) ? trk->sec[sects - 1].dataEnd - period : 0;
+	for (cnt = 0; (over > 0) && (cnt < sects) && (trk->sec[cnt].idPos < over); cnt++) {
+		free(trk->sec[cnt].data);
+	}
+	if (cnt != 0) {
+		memmove(trk->sec, trk->sec + cnt, (sects - cnt) * sizeof(struct emu_sector));
+		trk->sects -= cnt;
+	}
+	drv->modified = 1;
+	cmd->length = 0;
+	emuSetReply(cmd, 0x00, 0, 0, 0, 0, 0, n);
+	return 0;
+}
+
+/* Step the head, pulses faster than the mechanism follows are lost and the FDC does not notice */
+static int emuStep(struct emu_drive *drv, int pulses, int dir)
+{
+	int moved = pulses;
+
+	if ((pulses != 0) && (drv->stepTime < EMU_MINSTEP)) {
+		moved = 1 + (pulses - 1) * drv->stepTime / EMU_MINSTEP;
+	}
+	drv->cyl += dir * moved;
+	if (drv->cyl < 0) {
+		drv->cyl = 0;
+	} else if (drv->cyl > EMU_MAXCYL) {
+		drv->cyl = EMU_MAXCYL;
+	}
+	if (pulses != 0) {
+		EmuNow += pulses * drv->stepTime;
+		drv->settled = EmuNow + EMU_MINSETTLE;
+		EmuNow += drv->loadTime;
+		drv->changed = !drv->loaded;
+	}
+	return moved;
+}
+
+static int emuSeek(struct emu_drive *drv, struct floppy_raw_cmd *cmd, int cylinder)
+{
+	emuStep(drv, abs(cylinder - drv->pcn), (cylinder > drv->pcn) ? 1 : -1);
+	drv->pcn = cylinder;
+	cmd->reply[0] = FDC_ST0_SE | (cmd->cmd[1] & (FDC_SEL_HS | FDC_SEL_US1 | FDC_SEL_US0));
+	cmd->reply[1] = drv->pcn;
+	cmd->reply_count = 2;
+	return 0;
+}
+
+/* Step outward until the track 0 sensor, equipment check when it is not reached */
+static int emuRecalibrate(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	int pulses = drv->cyl;
+	unsigned char st0 = FDC_ST0_SE;
+
+	if ((pulses > 1) && (drv->stepTime < EMU_MINSTEP)) {
+		pulses = 1 + ((pulses - 1) * EMU_MINSTEP + drv->stepTime - 1) / drv->stepTime;
+	}
+	if (pulses > EMU_RECALSTEP) {
+		pulses = EMU_RECALSTEP;
+	}
+	emuStep(drv, pulses, -1);
+	if (drv->cyl != 0) {
+		st0 |= 0x40 | FDC_ST0_EC;
+	}
+	drv->pcn = 0;
+	cmd->reply[0] = st0 | (cmd->cmd[1] & (FDC_SEL_HS | FDC_SEL_US1 | FDC_SEL_US0));
+	cmd->reply[1] = drv->pcn;
+	cmd->reply_count = 2;
+	return 0;
+}
+
+/* Step rate and head load time scale with the clock of the data rate programmed */
+static int emuSpecify(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	int kbps = emuRateKbps(cmd->rate);
+	int srt = cmd->cmd[1] >> 4;
+	int hlt = cmd->cmd[2] >> 1;
+
+	drv->stepTime = (16 - srt) * 1000000LL * 500 / kbps;
+	drv->loadTime = ((hlt != 0) ? hlt : 128) * 2000000LL * 500 / kbps;
+	cmd->reply_count = 0;
+	return 0;
+}
+
+static int emuSenseDrive(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	unsigned char st3 = FDC_ST3_RY;
+
+	st3 |= cmd->cmd[1] & (FDC_ST3_HS | FDC_ST3_US1 | FDC_ST3_US0);
+	if (drv->cyl == 0) {
+		st3 |= FDC_ST3_T0;
+	}
+	if (drv->sides == 2) {
+		st3 |= FDC_ST3_TS;
+	}
+	if (drv->hdr.bWriteProtect != D88_PROTECT_OFF) {
+		st3 |= FDC_ST3_WP;
+	}
+	cmd->reply[0] = st3;
+	cmd->reply_count = 1;
+	return 0;
+}
+
+static int emuCommand(struct emu_drive *drv, struct floppy_raw_cmd *cmd)
+{
+	switch (cmd->cmd[0] & 0x1f) {
+		case FDC_CMD_SEEK:
+		case FDC_CMD_RECALIBRATE:
+		case FDC_CMD_SENSE_DRIVE:
+		case FDC_CMD_SPECIFY:
+			break;
+		default:
+			/* No index pulse without a disk, the driver times out */
+			if (!drv->loaded) {
+				return -1;
+			}
+			drv->used = 1;
+			break;
+	}
+	switch (cmd->cmd[0] & 0x1f) {
+		case FDC_CMD_READ_ID:
+			return emuReadId(drv, cmd);
+		case FDC_CMD_READ_DATA:
+		case FDC_CMD_READ_DELETED_DATA:
+			return emuTransfer(drv, cmd, EMU_READ);
+		case FDC_CMD_WRITE_DATA:
+		case FDC_CMD_WRITE_DELETED_DATA:
+			return emuTransfer(drv, cmd, EMU_WRITE);
+		case FDC_CMD_VERIFY:
+			return emuTransfer(drv, cmd, EMU_VERIFY);
+		case FDC_CMD_READ_TRACK:
+			return emuReadTrack(drv, cmd);
+		case FDC_CMD_FORMAT_TRACK:
+			return emuFormat(drv, cmd);
+		case FDC_CMD_SEEK:
+			return emuSeek(drv, cmd, cmd->cmd[2]);
+		case FDC_CMD_RECALIBRATE:
+			return emuRecalibrate(drv, cmd);
+		case FDC_CMD_SENSE_DRIVE:
+			return emuSenseDrive(drv, cmd);
+		case FDC_CMD_SPECIFY:
+			return emuSpecify(drv, cmd);
+		default:
+			/* Invalid command */
+			cmd->reply[0] = 0x80;
+			cmd->reply_count = 1;
+			return 0;
+	}
+}
+
+static int fdcEmuRawCmd(unsigned char unit, struct floppy_raw_cmd *cmd)
+{
+	struct emu_drive *drv = &EmuDrive[unit & (EMU_UNITS - 1)];
+
+	if (drv->path[0] == '\0') {
+		errno = ENXIO;
+		return -1;
+	}
+	EmuNow += EMU_LATENCY;
+	if (!drv->motor) {
+		EmuNow += EMU_SPINUP;
+		drv->motor = 1;
+	}
+	/* Chained commands follow in the array */
+	while (emuCommand(drv, cmd) == 0) {
+		if ((cmd->flags & FD_RAW_MORE) == 0) {
+			return 0;
+		}
+		/* Driver starts the next command from its interrupt work without returning to the caller */
+		EmuNow += EMU_CHAIN;
+		cmd++;
+	}
+	errno = EIO;
+	return -1;
+}
+
+/* Take out the disk, the image is saved if it was written */
+static void emuEject(struct emu_drive *drv)
+{
+	int trk;
+
+	if (drv->modified) {
+		emuSaveImage(drv);
+	}
+	for (trk = 0; trk < EMU_MAXTRK; trk++) {
+		emuFreeTrack(&drv->trk[trk]);
+	}
+	drv->loaded = 0;
+	drv->motor = 0;
+	drv->changed = 1;
+	drv->ejected = EmuNow;
+}
+
+/* Insert the next image of the queue, the head stays where it was */
+static int emuInsert(struct emu_drive *drv)
+{
+	int pcn = drv->pcn;
+	int cyl = drv->cyl;
+	long long stepTime = drv->stepTime;
+	long long loadTime = drv->loadTime;
+	char *next;
+	char queue[sizeof(drv->queue)];
+
+	snprintf(queue, sizeof(queue), "%s", drv->queue);
+	memset(drv, 0, sizeof(*drv));
+	if ((next = strchr(queue, ',')) != NULL) {
+		*next++ = '\0';
+		snprintf(drv->queue, sizeof(drv->queue), "%s", next);
+	}
+	snprintf(drv->path, sizeof(drv->path), "%s", queue);
+	drv->pcn = pcn;
+	drv->cyl = cyl;
+	drv->stepTime = stepTime;
+	drv->loadTime = loadTime;
+	drv->changed = 1;
+	if (emuLoadImage(drv, drv->path) != 0) {
+		return -1;
+	}
+	drv->loaded = 1;
+	return 0;
+}
+
+/* Open with an image, or a comma separated list of images changed one after another */
+static int fdcEmuOpen(unsigned char unit, const char *path)
+{
+	struct emu_drive *drv = &EmuDrive[unit & (EMU_UNITS - 1)];
+
+	memset(drv, 0, sizeof(*drv));
+	snprintf(drv->queue, sizeof(drv->queue), "%s", path);
+	drv->stepTime = EMU_STEP;
+	drv->loadTime = EMU_SETTLE;
+	return emuInsert(drv);
+}
+
+static void fdcEmuClose(unsigned char unit)
+{
+	struct emu_drive *drv = &EmuDrive[unit & (EMU_UNITS - 1)];
+
+	if (drv->loaded) {
+		emuEject(drv);
+	}
+	drv->path[0] = '\0';
+}
+
+static int fdcEmuReset(unsigned char unit)
+{
+	EmuNow += EMU_RESET;
+	return 0;
+}
+
+static long long fdcEmuClock(void)
+{
+	return EmuNow / 1000;
+}
+
+/* Disk change line, the emulated operator changes the disk once it was accessed */
+static int fdcEmuChanged(unsigned char unit)
+{
+	struct emu_drive *drv = &EmuDrive[unit & (EMU_UNITS - 1)];
+
+	if (drv->path[0] == '\0') {
+		errno = ENXIO;
+		return -1;
+	}
+	if (drv->loaded && drv->used) {
+		emuEject(drv);
+	}
+	if (!drv->loaded) {
+		if (drv->queue[0] == '\0') {
+			errno = ENOMEDIUM;
+			return -1;
+		}
+		if ((EmuNow >= drv->ejected + EMU_SWAP) && (emuInsert(drv) != 0)) {
+			return -1;
+		}
+	}
+	return drv->changed;
+}
+
+static void fdcEmuDelay(long long usec)
+{
+	EmuNow += usec * 1000;
+}
+
+static void fdcEmuSync(long long time)
+{
+	if (EmuNow < time * 1000) {
+		EmuNow = time * 1000;
+	}
+}
+
+struct fdc_backend fdcEmulator = {
+	.name   = "emulator",
+	.open   = fdcEmuOpen,
+	.close  = fdcEmuClose,
+	.reset  = fdcEmuReset,
+	.rawcmd = fdcEmuRawCmd,
+	.clock  = fdcEmuClock,
+	.sync   = fdcEmuSync,
+	.changed = fdcEmuChanged,
+	.delay  = fdcEmuDelay,
+};
@@ -0,0 +1,338 @@
+/*
+ * Implementation for FDC backend replaying a recorded trace
+ *
+ * Copyright (c) 2021 stzlab
+ *
+ * This software is released under the MIT License, see LICENSE.
+ */
+
+#include "fdc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <linux/fd.h>
+
+#define REPLAY_UNITS	4
+#define REPLAY_MISSREV	2			/* Revolutions a command not in the trace takes (index timeout) */
+
+/* Record of the trace with its variable part */
+struct replay_record {
+	struct fdc_trace_record rec;
+	unsigned char *cmd;
+	unsigned char *reply;
+	unsigned char *data;
+	int used;
+};
+
+static struct replay_record *Record;
+static int RecordNum;
+static int Cursor;					/* Record next to the last one replayed */
+static int Speed;					/* 0: no wait, 1: recorded speed, n: n times faster */
+static unsigned char *TraceBuf;
+static int Opened;
+static pthread_mutex_t ReplayLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long long ReplayNow;	/* Replayed time of the calling thread [usec] */
+
+/* Commands replayed in the recorded order, out of it, again, and not in the trace */
+static int InOrder;
+static int OutOfOrder;
+static int Reused;
+static int Missing;
+
+static int replayLoad(const char *path)
+{
+	long size;
+	long pos;
+	FILE *fp;
+	struct fdc_trace_header *hdr;
+	struct replay_record *r;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		perror("fdcReplay(fopen)");
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if ((size < (long)sizeof(*hdr)) || ((TraceBuf = malloc(size)) == NULL) || (fread(TraceBuf, size, 1, fp) != 1)) {
+		fprintf(stderr, "fdcReplay: cannot read trace %s\n", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	hdr = (struct fdc_trace_header *)TraceBuf;
+	if ((memcmp(hdr->magic, FDC_TRACE_MAGIC, sizeof(hdr->magic)) != 0) || (hdr->version != FDC_TRACE_VERSION)) {
+		fprintf(stderr, "fdcReplay: %s is not a trace\n", path);
+		return -1;
+	}
+
+	/* Index the records, a record cut by an interrupted recording ends the trace */
+	pos = sizeof(*hdr);
+	RecordNum = 0;
+	while (pos + (long)sizeof(struct fdc_trace_record) <= size) {
+		if ((RecordNum % 1024) == 0) {
+			if ((r = realloc(Record, sizeof(*Record) * (RecordNum + 1024))) == NULL) {
+				perror("fdcReplay(realloc)");
+				return -1;
+			}
+			Record = r;
+		}
+		r = &Record[RecordNum];
+		memcpy(&r->rec, TraceBuf + pos, sizeof(r->rec));
+		pos += sizeof(r->rec);
+		if (pos + r->rec.cmdCount + r->rec.replyCount + (long)r->rec.length > size) {
+			break;
+		}
+		r->cmd = TraceBuf + pos;
+		r->reply = r->cmd + r->rec.cmdCount;
+		r->data = r->reply + r->rec.replyCount;
+		r->used = 0;
+		pos += r->rec.cmdCount + r->rec.replyCount + r->rec.length;
+		RecordNum++;
+	}
+	return 0;
+}
+
+static int replayMatch(struct replay_record *r, unsigned char unit, struct floppy_raw_cmd *cmd)
+{
+	return (r->rec.type == FDC_TRACE_CMD) && (r->rec.unit == unit) && (r->rec.cmdCount == cmd->cmd_count)
+		&& (r->rec.rate == cmd->rate) && (memcmp(r->cmd, cmd->cmd, cmd->cmd_count) == 0);
+}
+
+/* Unused record of the same command, the next one in the trace first, then the last one used again
+   except READ ID, the same ID returned forever would never end an ID scan */
+static struct replay_record *replayFind(unsigned char unit, struct floppy_raw_cmd *cmd)
+{
+	int cnt;
+	int idx;
+	int last = -1;
+	int skipped = 0;
+	struct replay_record *r;
+
+	for (cnt = 0; cnt < RecordNum; cnt++) {
+		idx = (Cursor + cnt) % RecordNum;
+		r = &Record[idx];
+		if (!replayMatch(r, unit, cmd)) {
+			/* Other commands of the unit left behind, events and other units do not count */
+			skipped |= (r->rec.type == FDC_TRACE_CMD) && (r->rec.unit == unit) && !r->used;
+			continue;
+		}
+		if (r->used) {
+			last = (last < 0) ? idx : last;
+			continue;
+		}
+		if (skipped == 0) {
+			InOrder++;
+		} else {
+			OutOfOrder++;
+		}
+		Record[idx].used = 1;
+		Cursor = (idx + 1) % RecordNum;
+		return &Record[idx];
+	}
+	if ((last >= 0) && ((cmd->cmd[0] & 0x1f) != FDC_CMD_READ_ID)) {
+		Reused++;
+		return &Record[last];
+	}
+	Missing++;
+	return NULL;
+}
+
+/* Next unused event of the unit */
+static struct replay_record *replayEvent(int type, unsigned char unit)
+{
+	int cnt;
+
+	for (cnt = 0; cnt < RecordNum; cnt++) {
+		if ((Record[cnt].rec.type == type) && (Record[cnt].rec.unit == unit) && !Record[cnt].used) {
+			Record[cnt].used = 1;
+			return &Record[cnt];
+		}
+	}
+	return NULL;
+}
+
+static void replayWait(long long usec)
+{
+	struct timespec ts;
+
+	ReplayNow += usec;
+	if ((Speed == 0) || (usec <= 0)) {
+		return;
+	}
+	usec /= Speed;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+/* Reply of a command not in the trace, seeks end normally and the others find no sector */
+static long long replayMissing(struct floppy_raw_cmd *cmd)
+{
+	unsigned char sel = cmd->cmd[1] & (FDC_SEL_HS | FDC_SEL_US1 | FDC_SEL_US0);
+
+	switch (cmd->cmd[0] & 0x1f) {
+		case FDC_CMD_SEEK:
+		case FDC_CMD_RECALIBRATE:
+			cmd->reply[0] = FDC_ST0_SE | sel;
+			cmd->reply[1] = ((cmd->cmd[0] & 0x1f) == FDC_CMD_SEEK) ? cmd->cmd[2] : 0;
+			cmd->reply_count = 2;
+			return 0;
+		case FDC_CMD_SENSE_DRIVE:
+		case FDC_CMD_SPECIFY:
+			cmd->reply[0] = sel;
+			cmd->reply_count = ((cmd->cmd[0] & 0x1f) == FDC_CMD_SENSE_DRIVE) ? 1 : 0;
+			return 0;
+		default:
+			memset(cmd->reply, 0, 7);
+			cmd->reply[0] = 0x40 | sel;
+			cmd->reply[1] = ((cmd->cmd[0] & 0x1f) == FDC_CMD_READ_ID) ? FDC_ST1_MA : FDC_ST1_ND;
+			cmd->reply_count = 7;
+			return (long long)fdcGetRevTime() * REPLAY_MISSREV;
+	}
+}
+
+static int fdcReplayOpen(unsigned char unit, const char *path)
+{
+	char name[1024];
+	char *speed;
+	int ret = 0;
+
+	pthread_mutex_lock(&ReplayLock);
+	/* Trace is loaded by the first unit, the others replay their records of it */
+	if (TraceBuf == NULL) {
+		snprintf(name, sizeof(name), "%s", path);
+		if ((speed = strchr(name, ',')) != NULL) {
+			*speed++ = '\0';
+			Speed = atoi(speed);
+		}
+		ret = replayLoad(name);
+	}
+	if (ret == 0) {
+		Opened |= 1 << (unit & (REPLAY_UNITS - 1));
+	}
+	pthread_mutex_unlock(&ReplayLock);
+	return ret;
+}
+
+static void fdcReplayClose(unsigned char unit)
+{
+	pthread_mutex_lock(&ReplayLock);
+	Opened &= ~(1 << (unit & (REPLAY_UNITS - 1)));
+	if ((Opened == 0) && (TraceBuf != NULL)) {
+		printf("*Replay     : %d records / In order:%d / Out of order:%d / Reused:%d / Missing:%d\n",
+			RecordNum, InOrder, OutOfOrder, Reused, Missing);
+		free(Record);
+		free(TraceBuf);
+		Record = NULL;
+		TraceBuf = NULL;
+		RecordNum = 0;
+		Cursor = 0;
+	}
+	pthread_mutex_unlock(&ReplayLock);
+}
+
+static int fdcReplayReset(unsigned char unit)
+{
+	struct replay_record *r;
+
+	pthread_mutex_lock(&ReplayLock);
+	r = replayEvent(FDC_TRACE_RESET, unit);
+	pthread_mutex_unlock(&ReplayLock);
+	if (r != NULL) {
+		replayWait(r->rec.latency);
+	}
+	return 0;
+}
+
+static int fdcReplayRawCmd(unsigned char unit, struct floppy_raw_cmd *cmd)
+{
+	struct replay_record *r;
+	long transfer;
+	long long latency;
+
+	/* Chained commands follow in the array, a failed one ends the chain */
+	for (;;) {
+		pthread_mutex_lock(&ReplayLock);
+		if ((r = replayFind(unit, cmd)) == NULL) {
+			latency = replayMissing(cmd);
+		} else {
+			latency = r->rec.latency;
+			if (r->rec.result >= 0) {
+				memcpy(cmd->reply, r->reply, r->rec.replyCount);
+				cmd->reply_count = r->rec.replyCount;
+				/* Data read and the residual count as the backend left them */
+				if ((cmd->flags & (FD_RAW_READ | FD_RAW_WRITE)) != 0) {
+					transfer = (r->rec.length < cmd->length) ? r->rec.length : cmd->length;
+					if ((cmd->flags & FD_RAW_READ) != 0) {
+						memcpy(cmd->data, r->data, transfer);
+					}
+					cmd->length -= transfer;
+				}
+			}
+		}
+		pthread_mutex_unlock(&ReplayLock);
+		replayWait(latency);
+		if ((r != NULL) && (r->rec.result < 0)) {
+			errno = r->rec.error;
+			return -1;
+		}
+		if ((cmd->flags & FD_RAW_MORE) == 0) {
+			return 0;
+		}
+		cmd++;
+	}
+}
+
+static long long fdcReplayClock(void)
+{
+	return ReplayNow;
+}
+
+static void fdcReplaySync(long long time)
+{
+	if (ReplayNow < time) {
+		ReplayNow = time;
+	}
+}
+
+/* Disk change line as it was polled, no more disks after the last poll */
+static int fdcReplayChanged(unsigned char unit)
+{
+	struct replay_record *r;
+
+	pthread_mutex_lock(&ReplayLock);
+	r = replayEvent(FDC_TRACE_CHANGED, unit);
+	pthread_mutex_unlock(&ReplayLock);
+	if (r == NULL) {
+		errno = ENOMEDIUM;
+		return -1;
+	}
+	replayWait(r->rec.latency);
+	if (r->rec.result < 0) {
+		errno = r->rec.error;
+	}
+	return r->rec.result;
+}
+
+static void fdcReplayDelay(long long usec)
+{
+	replayWait(usec);
+}
+
+struct fdc_backend fdcReplay = {
+	.name   = "replay",
+	.open   = fdcReplayOpen,
+	.close  = fdcReplayClose,
+	.reset  = fdcReplayReset,
+	.rawcmd = fdcReplayRawCmd,
+	.clock  = fdcReplayClock,
+	.sync   = fdcReplaySync,
+	.changed = fdcReplayChanged,
+	.delay  = fdcReplayDelay,
+};
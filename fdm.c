@@ -10,25 +10,246 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "fdc.h"
 #include "d88.h"
+#include "trk.h"
 
 #define FD_DEVNUM			0
 #define MAXTRKLEN			12500		/* Maximum length of track(2HD@300rpm, Unformatted) */
 #define MAXSECNUM			66			/* Maximum number of sectors(2HD@300rpm, 128 bytes/sector,No GAP3,No GAP4b) */
+#define TRKPOOLNUM			4			/* Track buffers shared by drive and writer thread */
+#define TRKBUFLEN			(MAXSECNUM * 1024)	/* Preallocated data length of a track buffer */
+#define RESCUEREAD			4			/* Reads of a failed sector in each rescue pass */
+#define VERIFYRETRY			2			/* Rewrites of sectors failed to verify */
+#define BATCHPOLL			500000		/* Disk change polling interval of batch mode [usec] */
+#define PROBECACHE			256			/* Fingerprints kept in the probe cache */
+#define DETECT_MEDIA		0x01		/* Detect media parameters of each disk */
+#define DETECT_RANGE		0x02		/* Detect cylinder range too (not given by -C) */
+#define CALIBPASS			3			/* Runs of the seek pattern validating a setting */
+#define CALIBLOAD			30			/* Head load time of the profile, not calibrated as the head stays loaded [msec] */
+#define CALIBUNLOAD			240			/* Head unload time, long to keep the head loaded [msec] */
+#define REVBUCKETS			16			/* Revolutions per track histogram, 0.5 revolution each */
 
-#define GETENCFDC(enc)		(enc == D88_ENCODE_MFM) ? FDC_OPT_MFM : FDC_OPT_NONE
+#define GETENCFDC(enc)		((enc == D88_ENCODE_MFM) ? FDC_OPT_MFM : FDC_OPT_NONE)
 #define ISDAMDEL(dam)		(dam == D88_DAM_DELETED)
+#define ISSTATOK(st)		((st == 0x00) || (st == D88_STATUS_CM))
 
 static int verbose = 0;
+static int optimize = 0;
+
+/* Optimize flags */
+#define OPTIMIZE_MULTI		0x0001		/* Multi-sector read/write of a regular R run */
+#define OPTIMIZE_SCHED		0x0002		/* Rotation-aware sector read order */
+#define OPTIMIZE_BATCH		0x0004		/* Chain commands of a track (FD_RAW_MORE) */
+#define OPTIMIZE_PREDICT	0x0008		/* Reuse the geometry of the previous track */
+#define OPTIMIZE_PROBE		0x0010		/* Probe the expected encoding first */
+#define OPTIMIZE_FILL		0x0020		/* Format with the fill byte of uniform sectors */
+#define OPTIMIZE_MT			0x0040		/* Multi-track read of both heads */
+#define OPTIMIZE_CAPTURE	0x0080		/* Whole track by READ TRACK with software decoding */
+
+/* Retries counted by the stats report */
+enum {
+	RETRY_PREDICT = 0x00,					/* Track scanned again after wrong prediction */
+	RETRY_CAPTURE,							/* Track scanned by ID after failed capture */
+	RETRY_REWRITE,							/* Sectors written again after verify */
+	RETRY_RESCUE,							/* Sectors read again by rescue */
+	RETRY_NUM
+};
+const char *const RetryName[RETRY_NUM] = {
+	[RETRY_PREDICT] = "predict",
+	[RETRY_CAPTURE] = "capture",
+	[RETRY_REWRITE] = "rewrite",
+	[RETRY_RESCUE]  = "rescue",
+};
+
+/* Sectors of a track being read */
+struct track_buffer {
+	int trk;
+	int sects;
+	int enc;
+	int located;							/* IDs were read just before, head is past id[located - 1], 0: unknown */
+	struct fdc_sector_id id[MAXSECNUM];		/* Sector IDs in physical order */
+	long long idTime[MAXSECNUM + 1];		/* Time each ID passed the head, [sects] is the first ID again */
+	long long indexTime;					/* Index pulse before idTime, -1: IDs were not timed from it */
+	struct fdc_res_cmd res[MAXSECNUM];
+	unsigned char valid[MAXSECNUM];			/* Data and result are read */
+	struct D88_SECTOR sec[MAXSECNUM];		/* Sector headers of the image */
+	unsigned char *data[MAXSECNUM];
+	unsigned char *buf;
+	int bufSize;
+	unsigned int offset;					/* Track image offset and end in the image */
+	unsigned int end;
+	long long time;							/* Time the buffer was queued or released */
+};
+
+/* Sectors written by one WRITE DATA command */
+struct write_group {
+	int first;
+	int count;								/* More than 1: multi-sector write of an R run */
+};
+
+/* Format and write commands planned for a track of restore */
+struct track_plan {
+	int trk;
+	int cyl;
+	int head;
+	unsigned int offset;
+	int enc;								/* Format parameters */
+	int n;
+	int count;
+	int gap3;
+	int fill;
+	int sects;								/* Sectors in the image, 0: unformat */
+	int pending;							/* Sectors to be written */
+	int groups;
+	int padLen;								/* Bytes to pad short sectors up to the size of N */
+	struct D88_SECTOR *sec;
+	unsigned char **data;
+	struct fdc_sector_id id[MAXSECNUM];
+	unsigned char filled[MAXSECNUM];		/* Formatted with the fill byte, not written */
+	struct write_group group[MAXSECNUM];
+};
+
+/* Geometry expected on the next track of the same side */
+struct track_predict {
+	int cyl;
+	int enc;
+	int sects;
+	struct fdc_sector_id id[MAXSECNUM];
+};
+
+/* Head 1 data read together with head 0 by multi-track READ DATA */
+struct cylinder_cache {
+	int valid;
+	int cyl;
+	int enc;
+	int sects;
+	struct fdc_sector_id id[MAXSECNUM];		/* Head 0 IDs with H=1, R of 1 to sects */
+	unsigned char buf[MAXTRKLEN];
+};
+
+/* State of reading tracks from a drive */
+struct track_reader {
+	int dev;
+	int mult;
+	int trklen;
+	int expect;								/* Encoding of the last formatted track */
+	struct track_predict predict[2];
+	struct cylinder_cache cc;
+	struct cylinder_cache *ccPtr;			/* Multi-track read of both heads, NULL: disabled */
+};
+
+/* Failed sector recorded in the rescue map */
+struct rescue_entry {
+	int trk;
+	int cyl;
+	int head;
+	int enc;
+	int status;
+	unsigned int offset;					/* Sector header offset in the image */
+	struct fdc_sector_id id;
+};
+
+/* Track buffers passed from the drive thread to the image writer thread */
+struct dump_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	FILE *journal;
+	int filled;								/* Tracks queued by the drive thread */
+	int flushed;							/* Tracks written by the writer thread */
+	int closed;
+	int error;
+	struct track_buffer pool[TRKPOOLNUM];
+};
+
+/* Result of dumps, per disk and summed up over a batch session */
+struct dump_stats {
+	int disks;
+	int tracks;
+	int blank;
+	int sectors;
+	int errors;								/* Sectors failed after rescue */
+	long long time;
+};
+
+/* Media parameters detected from the disk */
+struct media_info {
+	int media;
+	int end;
+	int side;
+	int mult;
+	int rpm;
+	int kbps;
+	int drate;
+};
+
+/* Seek timing of a drive applied with SPECIFY */
+struct seek_profile {
+	int step;								/* Step rate [usec] */
+	int load;								/* Head load time [msec] */
+	int unload;								/* Head unload time [msec] */
+};
+
+/* Cylinder visited by the calibration pattern and the ID expected there */
+struct seek_point {
+	int cyl;
+	int enc;								/* -1: unformatted, not validated */
+	unsigned char c;
+};
+
+/* Tracks streamed from the source drive to the writer thread of the destination drive */
+struct copy_pipe {
+	struct dump_pipe dp;
+	int dev;
+	int mult;
+	int side;
+	int trklen;
+	int verify;
+	int tracks;								/* Tracks written */
+	int verified;
+	int rewrite;
+	int failed;
+	long long endTime;						/* Time the writer finished on its own clock */
+	struct track_plan plan;
+};
+
+/* Counters at the start of a track */
+struct track_stats {
+	long long time;
+	int retries;
+	struct fdc_stat cmd[FDC_STAT_NUM];
+};
+
+/* Session summary of the stats report, tracks may be finished by two threads */
+struct stats_report {
+	pthread_mutex_t lock;
+	FILE *log;								/* Stream of finished tracks (JSON lines) */
+	int tracks;
+	long long sectors;
+	long long errors;
+	long long time;
+	long long retry[RETRY_NUM];
+	long long rev[REVBUCKETS];
+};
+static struct stats_report Report = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread int Retries;
 
 enum {
 	OPT_2D  = 0x00,
 	OPT_2DD,
 	OPT_2HD,
 	OPT_1D,
-	OPT_1DD
+	OPT_1DD,
+	OPT_AUTO
 };
 char *const token_media[] = {
 	[OPT_2D]  = "2D",
@@ -36,6 +257,7 @@ char *const token_media[] = {
 	[OPT_2HD] = "2HD",
 	[OPT_1D]  = "1D",
 	[OPT_1DD] = "1DD",
+	[OPT_AUTO] = "auto",
 	NULL
 };
 
@@ -49,19 +271,66 @@ char *const token_switch[] = {
 	NULL
 };
 
+enum {
+	OPT_MULTI = 0x00,
+	OPT_SCHED,
+	OPT_BATCH,
+	OPT_PREDICT,
+	OPT_PROBE,
+	OPT_FILL,
+	OPT_MT,
+	OPT_CAPTURE
+};
+char *const token_optimize[] = {
+	[OPT_MULTI] = "multi",
+	[OPT_SCHED] = "sched",
+	[OPT_BATCH] = "batch",
+	[OPT_PREDICT] = "predict",
+	[OPT_PROBE] = "probe",
+	[OPT_FILL] = "fill",
+	[OPT_MT] = "mt",
+	[OPT_CAPTURE] = "capture",
+	NULL
+};
+
 void usage()
 {
 	printf("fdm v1.0\n");
-	printf("Usage: fdimage [dump|restore] <filename> <options>\n");
+	printf("Usage: fdimage [dump|restore|copy|batch|calibrate|timing] <filename> <options>\n");
+	printf("       (copy: <filename> is destination drive /dev/fd<n>, or D88 image with -E)\n");
+	printf("       (batch: <filename> is template, %%n: sequence number, %%d: date, %%t: time)\n");
+	printf("       (calibrate: <filename> is seek profile to save, needs a formatted disk)\n");
+	printf("       (timing: print timing map <filename>.tim of the image, -v for each sector)\n");
 	printf("  -h              : show usage\n");
 	printf("  -v              : enable verbose mode\n");
-	printf("  -m<type>        : media type(2D/2DD/2HD/1D/1DD) *default 2HD\n");
+	printf("  -r              : resume interrupted dump from its journal\n");
+	printf("  -d              : restore only tracks different from the image\n");
+	printf("  -V              : verify tracks after write and rewrite failed sectors\n");
+	printf("  -p              : print restore plan and exit\n");
+	printf("  -G              : record sector positions on dump, reproduce them on restore (map file <filename>.tim)\n");
+	printf("  -m<type>        : media type(2D/2DD/2HD/1D/1DD/auto) *default 2HD\n");
 	printf("  -w[on|off]      : overwrite write protect flag\n");
 	printf("  -C<start>-<end> : overwrite cylinder range\n");
 	printf("  -S<side>        : overwrite side select (0/1/2)\n");
 	printf("  -M<multiplier>  : overwrite physical drive seek mult multiplier\n");
 	printf("  -D<rpm>,<kbps>  : overwrite drive parameter\n");
 	printf("  -R<drate>       : overwrite drate register\n");
+	printf("  -O<mode,...>    : enable optimize mode (multi/sched/batch/predict/probe/fill/mt/capture)\n");
+	printf("  -B<cylinders>   : stop dump after consecutive blank cylinders\n");
+	printf("  -P<passes>      : retry failed sectors after dump (map file <filename>.map)\n");
+	printf("  -A<cache>       : cache media detected by -mauto with boot sector fingerprint\n");
+	printf("  -K<profile>     : apply seek profile of the drive (written by calibrate)\n");
+	printf("  -J<file>        : write command latency and track stats as JSON at the end\n");
+	printf("  -L<file>        : stream stats of each finished track as JSON lines\n");
+	printf("  -T<trace>       : record raw commands, replies and data to trace file\n");
+	printf("  -Y<trace>[,<n>] : replay trace instead of /dev/fd0 (n: 0 no wait, 1 recorded speed, n times faster)\n");
+	printf("  -E<image,...>   : use emulated FDC serving D88 image instead of /dev/fd0 (changed in turn by batch)\n");
+}
+
+/* Unformatted track length in bytes */
+int calcTrackLength(int rpm, int kbps)
+{
+	return (60 * kbps * 1000) / (rpm * 8);
 }
 
 int calcUnformatSizeNum(int trklen, int enc)
@@ -174,6 +443,128 @@ int convertStatus(struct fdc_res_cmd *res)
 	return code;
 }
 
+void printElapsed(long long startTime)
+{
+	long long elapsed = fdcGetTime() - startTime;
+	
+	printf("\n*Elapsed    : %lld.%.3lld sec / %.1f revolutions\n",
+		elapsed / 1000000, (elapsed / 1000) % 1000, (double)elapsed / fdcGetRevTime());
+}
+
+/* Count retries of the current track and of the session */
+void countRetry(int kind, int num)
+{
+	Retries += num;
+	pthread_mutex_lock(&Report.lock);
+	Report.retry[kind] += num;
+	pthread_mutex_unlock(&Report.lock);
+}
+
+/* Take counters of the calling thread before a track */
+void beginTrackStats(struct track_stats *ts)
+{
+	ts->time = fdcGetTime();
+	ts->retries = Retries;
+	fdcGetStats(ts->cmd, 1);
+}
+
+/* Account a finished track, and stream it as one JSON line */
+void endTrackStats(struct track_stats *ts, const char *op, int unit, int trk, int sects, int errors)
+{
+	int cnt;
+	int sep = 0;
+	int bucket;
+	long long time = fdcGetTime() - ts->time;
+	struct fdc_stat cmd[FDC_STAT_NUM];
+	
+	fdcGetStats(cmd, 1);
+	bucket = time * 2 / fdcGetRevTime();
+	bucket = (bucket < REVBUCKETS) ? bucket : REVBUCKETS - 1;
+	pthread_mutex_lock(&Report.lock);
+	Report.tracks++;
+	Report.sectors += sects;
+	Report.errors += errors;
+	Report.time += time;
+	Report.rev[bucket]++;
+	if (Report.log != NULL) {
+		fprintf(Report.log, "{\"op\":\"%s\",\"unit\":%d,\"track\":%d,\"sectors\":%d,\"errors\":%d,\"retries\":%d,"
+			"\"time\":%lld,\"revolutions\":%.2f,\"commands\":{",
+			op, unit, trk, sects, errors, Retries - ts->retries, time, (double)time / fdcGetRevTime());
+		for (cnt = 0; cnt < FDC_STAT_NUM; cnt++) {
+			if (cmd[cnt].count == ts->cmd[cnt].count) {
+				continue;
+			}
+			fprintf(Report.log, "%s\"%s\":{\"count\":%lld,\"errors\":%lld,\"time\":%lld}", (sep++ != 0) ? "," : "",
+				fdcStatName[cnt], cmd[cnt].count - ts->cmd[cnt].count, cmd[cnt].errors - ts->cmd[cnt].errors,
+				cmd[cnt].total - ts->cmd[cnt].total);
+		}
+		fprintf(Report.log, "}}\n");
+		fflush(Report.log);
+	}
+	pthread_mutex_unlock(&Report.lock);
+}
+
+/* Write the session summary, latency [usec] of each command class and revolutions per track */
+int writeStatsReport(char *filename)
+{
+	int cnt;
+	int bucket;
+	int sep;
+	long long total = 0;
+	FILE *fp;
+	struct fdc_stat cmd[FDC_STAT_NUM];
+	struct fdc_stat *st;
+	
+	if ((fp = fopen(filename, "w")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	fdcGetStats(cmd, 0);
+	pthread_mutex_lock(&Report.lock);
+	fprintf(fp, "{\n\t\"commands\": {\n");
+	for (cnt = 0; cnt < FDC_STAT_NUM; cnt++) {
+		st = &cmd[cnt];
+		fprintf(fp, "\t\t\"%s\": {\"count\":%lld,\"errors\":%lld,\"time\":%lld,\"mean\":%lld,\"min\":%lld,\"max\":%lld,\"histogram\":{",
+			fdcStatName[cnt], st->count, st->errors, st->total, (st->count != 0) ? st->total / st->count : 0, st->min, st->max);
+		/* Key is the upper bound of the bucket */
+		for (bucket = 0, sep = 0; bucket < FDC_STAT_BUCKETS; bucket++) {
+			if (st->hist[bucket] == 0) {
+				continue;
+			}
+			if (bucket < FDC_STAT_BUCKETS - 1) {
+				fprintf(fp, "%s\"%lld\":%lld", (sep++ != 0) ? "," : "", 1LL << bucket, st->hist[bucket]);
+			} else {
+				fprintf(fp, "%s\"inf\":%lld", (sep++ != 0) ? "," : "", st->hist[bucket]);
+			}
+		}
+		fprintf(fp, "}}%s\n", (cnt < FDC_STAT_NUM - 1) ? "," : "");
+	}
+	fprintf(fp, "\t},\n\t\"tracks\": {\"count\":%d,\"sectors\":%lld,\"errors\":%lld,\"time\":%lld,\"revolutions\":{",
+		Report.tracks, Report.sectors, Report.errors, Report.time);
+	for (bucket = 0, sep = 0; bucket < REVBUCKETS; bucket++) {
+		if (Report.rev[bucket] == 0) {
+			continue;
+		}
+		if (bucket < REVBUCKETS - 1) {
+			fprintf(fp, "%s\"%.1f\":%lld", (sep++ != 0) ? "," : "", (bucket + 1) * 0.5, Report.rev[bucket]);
+		} else {
+			fprintf(fp, "%s\"inf\":%lld", (sep++ != 0) ? "," : "", Report.rev[bucket]);
+		}
+	}
+	fprintf(fp, "}},\n\t\"retries\": {");
+	for (cnt = 0; cnt < RETRY_NUM; cnt++) {
+		fprintf(fp, "\"%s\":%lld,", RetryName[cnt], Report.retry[cnt]);
+		total += Report.retry[cnt];
+	}
+	fprintf(fp, "\"total\":%lld}\n}\n", total);
+	pthread_mutex_unlock(&Report.lock);
+	if (fclose(fp) != 0) {
+		perror("fclose");
+		return -1;
+	}
+	return 0;
+}
+
 int checkTrackEncoding(int dev, int head)
 {
 	int enc = -1;
@@ -194,304 +585,3179 @@ int checkTrackEncoding(int dev, int head)
 	return enc;
 }
 
-int readSectorSequence(int dev, int head, int enc, struct fdc_sector_id *idbuf)
+/* Check track encoding trying the expected one first, the other only if no ID is found */
+int probeTrackEncoding(int dev, int head, int expect)
+{
+	int other = (expect == D88_ENCODE_MFM) ? D88_ENCODE_FM : D88_ENCODE_MFM;
+	struct fdc_res_cmd res;
+	
+	if ((fdcReadId(dev, head, GETENCFDC(expect), &res) == 0) && (convertStatus(&res) == 0)) {
+		return expect;
+	}
+	if ((fdcReadId(dev, head, GETENCFDC(other), &res) == 0) && (convertStatus(&res) == 0)) {
+		return other;
+	}
+	return -1;
+}
+
+/* Check track encoding with the probe mode if enabled */
+int detectTrackEncoding(int dev, int head, int expect)
+{
+	if ((optimize & OPTIMIZE_PROBE) != 0) {
+		return probeTrackEncoding(dev, head, expect);
+	}
+	return checkTrackEncoding(dev, head);
+}
+
+/* Seek and check track encoding with one command chain, returns -2 on error */
+int seekTrackEncoding(int dev, int cylinder, int head, int expect)
+{
+	int enc = -1;
+	int other = (expect == D88_ENCODE_MFM) ? D88_ENCODE_FM : D88_ENCODE_MFM;
+	struct fdc_res_intr intr;
+	struct fdc_res_cmd res[2];
+	
+	fdcBatchBegin();
+	fdcSeek(dev, cylinder, &intr);
+	if ((optimize & OPTIMIZE_PROBE) != 0) {
+		/* Expected encoding only, the other is read after it failed */
+		fdcReadId(dev, head, GETENCFDC(expect), &res[0]);
+		if (fdcBatchSubmit(dev) != 0) {
+			return -2;
+		}
+		if (convertStatus(&res[0]) == 0) {
+			return expect;
+		}
+		if ((fdcReadId(dev, head, GETENCFDC(other), &res[1]) == 0) && (convertStatus(&res[1]) == 0)) {
+			return other;
+		}
+		return -1;
+	}
+	fdcReadId(dev, head, FDC_OPT_NONE, &res[0]);
+	fdcReadId(dev, head, FDC_OPT_MFM, &res[1]);
+	if (fdcBatchSubmit(dev) != 0) {
+		return -2;
+	}
+	if (convertStatus(&res[0]) == 0) {
+		enc = D88_ENCODE_FM;
+	}
+	if (convertStatus(&res[1]) == 0) {
+		enc = D88_ENCODE_MFM;
+	}
+	return enc;
+}
+
+/* Print track numbers flagged in the list as ranges */
+void printTrackList(char *title, unsigned char *list, int num)
+{
+	int trk;
+	int first = -1;
+	int found = 0;
+	
+	printf("%s:", title);
+	for (trk = 0; trk <= num; trk++) {
+		if ((trk < num) && (list[trk] != 0)) {
+			first = (first < 0) ? trk : first;
+			continue;
+		}
+		if (first >= 0) {
+			printf((first == trk - 1) ? " %d" : " %d-%d", first, trk - 1);
+			first = -1;
+			found = 1;
+		}
+	}
+	printf("%s\n", (found != 0) ? "" : " none");
+}
+
+int readSectorSequence(int dev, int head, int enc, int position, struct fdc_sector_id *idbuf, long long *timebuf,
+	long long *indexTime)
 {
 	int cnt = 0;
+	int idx;
+	int first = 0;
+	long long index = -1;
+	long long rev;
+	long long time[MAXSECNUM + 1];
+	long long rotTime[MAXSECNUM];
+	struct fdc_sector_id id[MAXSECNUM];
 	struct fdc_sector_id *idptr = idbuf;
 	struct fdc_res_cmd res;
 	
 	/* Positioning first sector */
-	fdcReadId(dev, head, (enc == D88_ENCODE_MFM) ? FDC_OPT_NONE : FDC_OPT_MFM, &res);
+	if (position != 0) {
+		fdcReadId(dev, head, (enc == D88_ENCODE_MFM) ? FDC_OPT_NONE : FDC_OPT_MFM, &res);
+		/* No ID of the other encoding, the command ended at the index */
+		index = (convertStatus(&res) != 0) ? fdcGetTime() : -1;
+	}
+	if (indexTime != NULL) {
+		*indexTime = index;
+	}
 	
 	/* Loop read sector ID */
-	do {
+	for (;;) {
 		fdcReadId(dev, head, GETENCFDC(enc), &res);
 		if (convertStatus(&res) != 0) {
 			return 0;
 		}
+		/* Time the ID passed the head */
+		time[cnt] = fdcGetTime();
 		/* same R ID detected */
 		if ((cnt != 0) && (idbuf[0].r == res.r)) {
 			break;
 		}
+		/* R not repeated within the buffer, the track is unreadable */
+		if (cnt >= MAXSECNUM) {
+			printf("[ReadId] Side:%d / No repeat in %d IDs\n", head, cnt);
+			return 0;
+		}
 		memcpy(idptr++, &res.c, sizeof(struct fdc_sector_id));
-	} while (cnt++ < MAXSECNUM);
+		cnt++;
+	}
+	
+	/* First ID after the index passed while the command was issued, start the sequence at it (head is not past it) */
+	if ((index >= 0) && (cnt > 1)) {
+		rev = time[cnt] - time[0];
+		for (idx = 1; idx < cnt; idx++) {
+			first = ((time[idx] - index) % rev < (time[first] - index) % rev) ? idx : first;
+		}
+		memcpy(id, idbuf, sizeof(*id) * cnt);
+		memcpy(rotTime, time, sizeof(*time) * cnt);
+		for (idx = 0; idx < cnt; idx++) {
+			idbuf[idx] = id[(first + idx) % cnt];
+			time[idx] = rotTime[(first + idx) % cnt] + ((first + idx >= cnt) ? rev : 0);
+		}
+		time[cnt] = time[0] + rev;
+	}
+	if (timebuf != NULL) {
+		memcpy(timebuf, time, sizeof(*time) * (cnt + 1));
+	}
 	return cnt;
 }
 
-int dumpFloppyDisk(int start, int end, int mult, int side, int media, int protect, char *filename)
+/* Allocate data area of each sector in physical order */
+int setTrackBuffer(struct track_buffer *tb, int sects, int enc)
 {
-	int trk;
-	int cyl;
-	int head;
-	int sects;
 	int cnt;
-	int offset;
-	int enc;
-	unsigned char data[MAXTRKLEN];
+	int size = 0;
 	
-	FILE *fo;
-	struct D88_HEADER dsk;
-	struct D88_SECTOR sec;
+	for (cnt = 0; cnt < sects; cnt++) {
+		size += NSECSIZE(tb->id[cnt].n);
+	}
+	if (size > tb->bufSize) {
+		if ((tb->buf = realloc(tb->buf, size)) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		tb->bufSize = size;
+	}
+	memset(tb->buf, 0, size);
+	memset(tb->valid, 0, sizeof(tb->valid));
+	memset(tb->res, 0, sizeof(tb->res));
+	size = 0;
+	for (cnt = 0; cnt < sects; cnt++) {
+		tb->data[cnt] = tb->buf + size;
+		size += NSECSIZE(tb->id[cnt].n);
+	}
+	tb->sects = sects;
+	tb->enc = enc;
+	tb->located = 1;
+	return 0;
+}
+
+/* Read a regular run of R with one multi-sector READ DATA into the track buffer */
+int readSectorRun(int dev, int head, struct track_buffer *tb)
+{
+	int cnt;
+	int minr = 0xff;
+	int maxr = 0x00;
+	int seg;
+	int first;
+	int last;
+	int size;
+	int sects = tb->sects;
+	unsigned char runBuf[MAXTRKLEN];
+	unsigned char runValid[256];
+	struct fdc_sector_id *idbuf = tb->id;
+	struct fdc_sector_id id;
 	struct fdc_res_cmd res;
-	struct fdc_res_intr intr;
-	struct fdc_sector_id *idPtr;
-	struct fdc_sector_id idBuf[MAXSECNUM];
 	
-	printf("Dump Started\n");
-	printf("*Cylinder   : %d - %d\n", start, end);
-	printf("*Step       : %d\n", mult);
-	printf("*Side       : %d\n", side);
-	printf("*MediaType  : %.2x\n", media);
-	printf("*WiteProtect: %.2x\n", protect);
-	printf("*Filename   : %s\n", filename);
-
-	/* Open(write) disk image file */
-	if ((fo = fopen(filename, "wb")) == NULL) {
-		perror("fopen");
-		fclose(fo);
-		return -1;
+	if (sects < 2) {
+		return 0;
 	}
-	
-	/* Set and write disk image header */
-	memset(&dsk, 0, sizeof(dsk));
-	dsk.bMediaType = media;
-	dsk.bWriteProtect = protect;
-	if( fwrite(&dsk, sizeof(dsk), 1, fo) < 0) {
-		perror("fwrite");
-		return -1;
+	/* Check same C H N and R ascending by one in physical order (wrap around once) */
+	for (cnt = 0; cnt < sects; cnt++) {
+		if ((idbuf[cnt].c != idbuf[0].c) || (idbuf[cnt].h != idbuf[0].h) || (idbuf[cnt].n != idbuf[0].n)) {
+			return 0;
+		}
+		minr = (idbuf[cnt].r < minr) ? idbuf[cnt].r : minr;
+		maxr = (idbuf[cnt].r > maxr) ? idbuf[cnt].r : maxr;
+		if ((cnt != 0) && (idbuf[cnt].r != idbuf[cnt - 1].r + 1) && (idbuf[cnt].r != minr)) {
+			return 0;
+		}
 	}
-	offset = sizeof(dsk);
-	/* Read tracks from floppy disk */
-	trk = (side == 2) ? start * 2: start;
-	for (cyl = start; cyl <= end; cyl++) {
-		head = (side == 2) ? 0 : side;
-		do {
-			printf("\nTrack: %d / Offset: 0x%.8x\n", trk, offset);
-			printf("[Seek] Cylinder:%d / Step:%d\n", cyl, mult);
-			
-			sects = 0;
-			memset(&idBuf, 0, sizeof(idBuf));
-			/* Seek floppy */
-			if (fdcSeek(FD_DEVNUM, cyl * mult, &intr) != 0) {
-				printf("fdcSeek error\n");
-				return -1;
-			}
-			/* Check track encoding */
-			if ((enc = checkTrackEncoding(FD_DEVNUM, head)) != -1) {
-				/* Read sector sequence */
-				if ((sects = readSectorSequence(FD_DEVNUM, head, enc, idBuf)) != 0) {
-					/* Set track image address */
-					dsk.adwTrackOffsets[trk] = offset;
-				}
+	size = NSECSIZE(idbuf[0].n);
+	if ((maxr - minr + 1 != sects) || (size * sects > MAXTRKLEN)) {
+		return 0;
+	}
+	
+	/* Read run from the sector next under the head and then wrap around to the first R,
+	   restart after the sector reported an error. Whole run at once if the head position is unknown */
+	memset(runValid, 0, sizeof(runValid));
+	memcpy(&id, &idbuf[0], sizeof(id));
+	for (seg = 0; seg < 2; seg++) {
+		first = (seg == 0) ? ((tb->located != 0) ? idbuf[tb->located % sects].r : minr) : minr;
+		last = (seg == 0) ? maxr : ((tb->located != 0) ? idbuf[tb->located % sects].r - 1 : minr - 1);
+		while (first <= last) {
+			id.r = first;
+			if (fdcReadMultiData(dev, head, GETENCFDC(tb->enc), &id, last, 0, runBuf + (first - minr) * size, &res) != 0) {
+				break;
 			}
-			printf("[ReadData] Side:%d / Encode:%.2X / Sectors:%d\n", head, enc, sects);
-			if (verbose != 0) {
-				printf(" C  H  R  N  : RESULT CODE   : DATA\n");
+			if (convertStatus(&res) == 0) {
+				memset(runValid + (first - minr), 1, last - first + 1);
+				break;
 			}
-			idPtr = idBuf;
-			for (cnt = 0; cnt < sects; cnt++) {
-				/* Initialize buffer */
-				memset(&sec, 0, sizeof(sec));
-				memset(&data, 0, sizeof(data));
-				/* Read sector data from floppy */
-				if (fdcReadData(FD_DEVNUM, head, GETENCFDC(enc), idPtr, 0, data, &res) != 0) {
-					printf("fdcReadData error\n");
-				}
-				/* Write sector header to file */
-				memcpy(&sec.c, idPtr, sizeof(struct fdc_sector_id));
-				sec.wSectors = sects;
-				sec.bEncoding = enc;
-				sec.wLength = NSECSIZE(idPtr->n) ;
-				sec.bStatus = convertStatus(&res);
-				sec.bDataAddressMark = (sec.bStatus & D88_STATUS_CM) ? D88_DAM_DELETED : D88_DAM_NORMAL;
-				if (verbose != 0) {
-					printf(" %.2X %.2X %.2X %.2X : %.2X (%.2X %.2X %.2X) : %.2X\n",
-						sec.c, sec.h, sec.r, sec.n, sec.bStatus, res.st0, res.st1, res.st2, data[0]);
-				}
-				if(fwrite(&sec, sizeof(sec), 1, fo) < 0) {
-					perror("fwrite");
-					return -1;
-				}
-				/* Write sector data to file */
-				if(fwrite(&data, sec.wLength, 1, fo) < 0) {
-					perror("fwrite");
-					return -1;
-				}
-				offset += sizeof(sec) + sec.wLength;
-				idPtr++;
+			if ((res.r < first) || (res.r > last)) {
+				break;
 			}
-			trk++;
-			head++;
-		} while (head != side);
-	}
-	dsk.dwDiskSize = offset;
-	
-	if(fseek(fo, 0, SEEK_SET) != 0) {
-		perror("fseek");
-		return -1;
+			memset(runValid + (first - minr), 1, res.r - first);
+			first = res.r + 1;
+		}
 	}
-	if( fwrite(&dsk, sizeof(dsk), 1, fo) < 0) {
-		perror("fwrite");
-		return -1;
+	/* Split into sectors */
+	for (cnt = 0; cnt < sects; cnt++) {
+		if (runValid[idbuf[cnt].r - minr] != 0) {
+			memcpy(tb->data[cnt], runBuf + (idbuf[cnt].r - minr) * size, size);
+			tb->valid[cnt] = 1;
+		}
 	}
-	fclose(fo);
-	printf("Dump Ended\n");
-	return 0;
+	return sects;
 }
 
-int restoreFloppyDisk(int start, int end, int mult, int side, int trklen, char *filename)
+/* Read pending sectors choosing the one whose ID comes under the head first */
+int readSectorScheduled(int dev, int head, struct track_buffer *tb)
 {
-	int trk;
-	int cyl;
-	int head;
-	int sects;
+	static long long lead = 0;		/* Time needed from command issue to catch an ID [usec] */
 	int cnt;
-	int offset;
-	int gap3;
-	unsigned char data[MAXTRKLEN];
-	unsigned char *dataPtr;
-	size_t ret;
-	
-	FILE *fp;
-	struct D88_HEADER dsk;
-	struct D88_SECTOR secBuf[MAXSECNUM];
-	struct D88_SECTOR *secPtr;
-	struct fdc_sector_id idBuf[MAXSECNUM];
-	struct fdc_sector_id *idPtr;
-	struct fdc_res_cmd res;
-	struct fdc_res_intr intr;
-	
-	printf("Restore Started\n");
-	printf("*Cylinder   : %d - %d\n", start, end);
-	printf("*Step       : %d\n", mult);
-	printf("*Side       : %d\n", side);
-	printf("*TrackLength: %d\n", trklen);
-	printf("*Filename   : %s\n", filename);
+	int next;
+	int pending = 0;
+	long long rev;
+	long long now;
+	long long wait;
+	long long best;
+	long long phase[MAXSECNUM];
+	long long space[MAXSECNUM];
 	
-	/* Open(read) disk image file */
-	if ((fp = fopen(filename, "rb")) == NULL) {
-		perror("fopen");
-		fclose(fp);
-		return -1;
+	/* Phase of each ID from the first one, revolution time measured by the same ID detected */
+	rev = tb->idTime[tb->sects] - tb->idTime[0];
+	if ((rev <= 0) || (rev > 2 * fdcGetRevTime())) {
+		rev = fdcGetRevTime();
 	}
-	/* Read disk image header */
-	ret = fread(&dsk, sizeof(dsk), 1, fp);
-	if( ret < 0) {
-		perror("fread");
-		return -1;
+	if (lead == 0) {
+		lead = rev / 64;
+	}
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		phase[cnt] = (tb->idTime[cnt] - tb->idTime[0]) % rev;
+		pending += (tb->valid[cnt] == 0);
+	}
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		space[cnt] = (tb->sects == 1) ? rev : (phase[(cnt + 1) % tb->sects] - phase[cnt] + rev) % rev;
 	}
-	printf("*Title      : %s\n", dsk.szTitle);
-	printf("*WiteProtect: %.2x\n", dsk.bWriteProtect);
-	printf("*MediaType  : %.2x\n", dsk.bMediaType);
 	
-	/* Read tracks from file */
-	trk = (side == 2) ? start * 2: start;
-	for (cyl = start; cyl <= end; cyl++) {
-		head = (side == 2) ? 0 : side;
-		do {
-			offset = dsk.adwTrackOffsets[trk];
-			printf("\nTrack: %d / Offset: 0x%.8x\n", trk, offset);
-			
-			memset(&idBuf, 0, sizeof(idBuf));
-			memset(&data, 0, sizeof(data));
-			memset(&secBuf, 0,sizeof(secBuf));
-			secPtr = secBuf;
-			idPtr = idBuf;
-			dataPtr = data;
-			
-			/* Set sector image */
-			if (offset == 0) {
-				/* Set unformat parameter*/
-				secBuf[0].bEncoding = D88_ENCODE_MFM;
-				secBuf[0].n = calcUnformatSizeNum(trklen, secBuf[0].bEncoding);
-				secBuf[0].wSectors = 1;
-				idBuf[0].n = secBuf[0].n ;
-				gap3 = 0;
-			} else {
-				/* Seek file */
-				if(fseek(fp, offset, SEEK_SET) != 0) {
-					perror("fseek");
-					return -1;
-				}
-				cnt = 0;
-				do {
-					/* Read sector header from file */
-					ret = fread(secPtr, sizeof(struct D88_SECTOR), 1, fp);
-					if(ret < 0) {
-						perror("fread");
-						return -1;
+	while (pending != 0) {
+		/* Pick the pending sector with the shortest rotational wait */
+		now = fdcGetTime();
+		next = -1;
+		best = 0;
+		for (cnt = 0; cnt < tb->sects; cnt++) {
+			if (tb->valid[cnt] != 0) {
+				continue;
+			}
+			wait = ((phase[cnt] - (now - tb->idTime[0]) - lead) % rev + rev) % rev;
+			if ((next < 0) || (wait < best)) {
+				next = cnt;
+				best = wait;
+			}
+		}
+		if (fdcReadData(dev, head, GETENCFDC(tb->enc), &tb->id[next], 0, tb->data[next], &tb->res[next]) != 0) {
+			printf("fdcReadData error\n");
+		}
+		tb->valid[next] = 1;
+		pending--;
+		/* ID was missed, take more lead time */
+		if ((fdcGetTime() - now > lead + best + space[next] + rev / 64) && (lead < rev / 2)) {
+			lead += rev / 64;
+		}
+	}
+	return tb->sects;
+}
+
+/* Check sectors are in ascending R order with the same C H N, normal DAM and no error */
+int checkSectorRun(struct D88_SECTOR *secbuf, int sects)
+{
+	int cnt;
+	
+	if (sects < 2) {
+		return 0;
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		if ((secbuf[cnt].c != secbuf[0].c) || (secbuf[cnt].h != secbuf[0].h) || (secbuf[cnt].n != secbuf[0].n)
+			|| (secbuf[cnt].r != secbuf[0].r + cnt) || (secbuf[cnt].bEncoding != secbuf[0].bEncoding)
+			|| (secbuf[cnt].wLength != NSECSIZE(secbuf[0].n)) || ISDAMDEL(secbuf[cnt].bDataAddressMark)
+			|| (secbuf[cnt].bStatus != 0x00)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Read pending sectors with one command chain in physical order from the sector next under the head */
+int readSectorBatch(int dev, int head, struct track_buffer *tb)
+{
+	int cnt;
+	int idx;
+	unsigned char queued[MAXSECNUM];
+	
+	memset(queued, 0, sizeof(queued));
+	fdcBatchBegin();
+	for (cnt = 1; cnt <= tb->sects; cnt++) {
+		idx = cnt % tb->sects;
+		if (tb->valid[idx] == 0) {
+			fdcReadData(dev, head, GETENCFDC(tb->enc), &tb->id[idx], 0, tb->data[idx], &tb->res[idx]);
+			queued[idx] = 1;
+		}
+	}
+	if (fdcBatchSubmit(dev) != 0) {
+		return -1;
+	}
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		tb->valid[cnt] |= queued[cnt];
+	}
+	return tb->sects;
+}
+
+/* Read head 0 and head 1 of a cylinder with one multi-track READ DATA, head 1 data is kept in the cache */
+int readCylinderRun(int dev, int cyl, struct track_buffer *tb, struct cylinder_cache *cc)
+{
+	int cnt;
+	int size;
+	int first;
+	int sects = tb->sects;
+	unsigned char runBuf[MAXTRKLEN * 2];
+	unsigned char runValid[256];
+	struct fdc_sector_id id;
+	struct fdc_res_cmd res;
+	
+	cc->valid = 0;
+	if (sects < 1) {
+		return 0;
+	}
+	/* Check same C N on head 0 and R of 1 to sects ascending by one in physical order (wrap around once) */
+	memset(runValid, 0, sizeof(runValid));
+	for (cnt = 0; cnt < sects; cnt++) {
+		if ((tb->id[cnt].c != tb->id[0].c) || (tb->id[cnt].h != 0) || (tb->id[cnt].n != tb->id[0].n)
+			|| (tb->id[cnt].r < 1) || (tb->id[cnt].r > sects) || (runValid[tb->id[cnt].r] != 0)
+			|| ((cnt != 0) && (tb->id[cnt].r != tb->id[cnt - 1].r + 1) && (tb->id[cnt].r != 1))) {
+			return 0;
+		}
+		runValid[tb->id[cnt].r] = 1;
+	}
+	size = NSECSIZE(tb->id[0].n);
+	if (size * sects > MAXTRKLEN) {
+		return 0;
+	}
+	
+	/* Start from the sector next under the head, transfer continues from R=1 of head 1 */
+	first = ((tb->located != 0) && (sects > 1)) ? tb->id[tb->located % sects].r : 1;
+	memcpy(&id, &tb->id[0], sizeof(id));
+	id.r = first;
+	if (fdcReadMultiData(dev, 0, GETENCFDC(tb->enc) | FDC_OPT_MT, &id, sects, 0, runBuf + (first - 1) * size, &res) != 0) {
+		return 0;
+	}
+	memset(runValid, 0, sizeof(runValid));
+	if ((convertStatus(&res) == 0) || (res.h != 0)) {
+		memset(runValid + first, 1, sects - first + 1);
+	} else if ((res.r >= first) && (res.r <= sects)) {
+		memset(runValid + first, 1, res.r - first);
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		if (runValid[tb->id[cnt].r] != 0) {
+			memcpy(tb->data[cnt], runBuf + (tb->id[cnt].r - 1) * size, size);
+			tb->valid[cnt] = 1;
+		}
+	}
+	/* Keep head 1 with the same geometry only when the whole transfer completed */
+	if (convertStatus(&res) == 0) {
+		memcpy(cc->buf, runBuf + sects * size, sects * size);
+		for (cnt = 0; cnt < sects; cnt++) {
+			cc->id[cnt] = tb->id[cnt];
+			cc->id[cnt].h = 1;
+		}
+		cc->valid = 1;
+		cc->cyl = cyl;
+		cc->enc = tb->enc;
+		cc->sects = sects;
+		printf("[MultiTrack] Side:0-1 / Sectors:%d\n", sects);
+	}
+	return sects;
+}
+
+/* Take head 1 data read by multi-track READ DATA for the scanned IDs of the cache, returns the number of them */
+int readCylinderCache(struct track_buffer *tb, struct cylinder_cache *cc)
+{
+	int cnt;
+	int idx;
+	int cached = 0;
+	int size = NSECSIZE(cc->id[0].n);
+	unsigned char seen[256];
+	
+	cc->valid = 0;
+	/* Data of R found twice could be of either sector */
+	memset(seen, 0, sizeof(seen));
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		if (seen[tb->id[cnt].r] != 0) {
+			return 0;
+		}
+		seen[tb->id[cnt].r] = 1;
+	}
+	for (cnt = 0; (cnt < tb->sects) && (tb->enc == cc->enc); cnt++) {
+		for (idx = 0; idx < cc->sects; idx++) {
+			if (memcmp(&tb->id[cnt], &cc->id[idx], sizeof(struct fdc_sector_id)) == 0) {
+				memcpy(tb->data[cnt], cc->buf + (tb->id[cnt].r - 1) * size, size);
+				tb->valid[cnt] = 1;
+				cached++;
+				break;
+			}
+		}
+	}
+	printf("[MultiTrack] Side:1 / Sectors:%d / Cached:%d\n", tb->sects, cached);
+	return cached;
+}
+
+/* Read data of all sectors in the track buffer with enabled optimize modes */
+void readTrackData(int dev, int head, struct track_buffer *tb)
+{
+	int cnt;
+	int pending = 0;
+	
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		pending += (tb->valid[cnt] == 0);
+	}
+	if (pending == 0) {
+		return;
+	}
+	/* Read whole R run at once */
+	if (((optimize & OPTIMIZE_MULTI) != 0) && (pending == tb->sects)) {
+		readSectorRun(dev, head, tb);
+	}
+	/* Read sectors in rotational order */
+	if ((optimize & OPTIMIZE_BATCH) != 0) {
+		readSectorBatch(dev, head, tb);
+	} else if ((optimize & OPTIMIZE_SCHED) != 0) {
+		readSectorScheduled(dev, head, tb);
+	}
+	/* Read remaining sectors one by one */
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		if ((tb->valid[cnt] == 0)
+			&& (fdcReadData(dev, head, GETENCFDC(tb->enc), &tb->id[cnt], 0, tb->data[cnt], &tb->res[cnt]) != 0)) {
+			printf("fdcReadData error\n");
+		}
+		tb->valid[cnt] = 1;
+	}
+}
+
+/* Read a track of dump, both heads of a cylinder at once in multi-track mode (head 1 IDs are scanned still) */
+void readDumpTrack(int dev, int cyl, int head, struct track_buffer *tb, struct cylinder_cache *cc)
+{
+	if ((cc != NULL) && (head == 0)) {
+		readCylinderRun(dev, cyl, tb, cc);
+	} else if ((cc != NULL) && (cc->valid != 0) && (cc->cyl == cyl)) {
+		readCylinderCache(tb, cc);
+	}
+	readTrackData(dev, head, tb);
+}
+
+/* Read a whole track with one READ TRACK and decode sectors in software */
+int captureTrack(int dev, int head, int enc, int trklen, struct track_buffer *tb)
+{
+	int cnt;
+	int sects;
+	long revLen = (enc == D88_ENCODE_MFM) ? trklen : trklen / 2;
+	long len;
+	unsigned char raw[MAXTRKLEN * 2];
+	struct fdc_sector_id id = { 0, head, 1, 0 };
+	struct fdc_res_cmd res;
+	struct fdc_res_cmd *rp;
+	struct trk_sector sec[MAXSECNUM * 2];
+	
+	/* One oversized sector from the first data field after the index, until the second sector comes again */
+	len = revLen * 17 / 16 + NSECSIZE(3) + 256;
+	if (len > sizeof(raw)) {
+		len = sizeof(raw);
+	}
+	while ((NSECSIZE(id.n) < len) && (id.n < 7)) {
+		id.n++;
+	}
+	if ((fdcReadDiag(dev, head, GETENCFDC(enc), &id, len, raw, &res) != 0) || ((res.st1 & FDC_ST1_MA) != 0)) {
+		return -1;
+	}
+	sects = trkDecode(raw, len, enc, revLen, sec, MAXSECNUM * 2);
+	if ((sects <= 0) || (sects > MAXSECNUM)) {
+		printf("[Capture] Decode failed\n");
+		return -1;
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		tb->id[cnt] = sec[cnt].id;
+	}
+	if (setTrackBuffer(tb, sects, enc) != 0) {
+		return -1;
+	}
+	memset(tb->idTime, 0, sizeof(tb->idTime));
+	
+	/* Results as READ DATA reports them */
+	for (cnt = 0; cnt < sects; cnt++) {
+		rp = &tb->res[cnt];
+		memcpy(&rp->c, &sec[cnt].id, sizeof(sec[cnt].id));
+		switch (sec[cnt].status) {
+			case D88_STATUS_DE:
+				rp->st0 = 0x40;
+				rp->st1 = FDC_ST1_DE;
+				break;
+			case D88_STATUS_MD:
+				rp->st0 = 0x40;
+				rp->st1 = FDC_ST1_MA;
+				rp->st2 = FDC_ST2_MD;
+				break;
+			case D88_STATUS_DD:
+				rp->st0 = 0x40;
+				rp->st1 = FDC_ST1_DE;
+				rp->st2 = FDC_ST2_DD;
+				break;
+			case D88_STATUS_CM:
+				rp->st2 = FDC_ST2_CM;
+				break;
+		}
+		if ((sec[cnt].status != D88_STATUS_DE) && (sec[cnt].status != D88_STATUS_MD)) {
+			trkGetData(raw, len, &sec[cnt], tb->data[cnt]);
+		}
+		/* Data CRC error of the capture is left to READ DATA */
+		tb->valid[cnt] = (sec[cnt].status != D88_STATUS_DD);
+	}
+	printf("[Capture] Sectors:%d\n", sects);
+	return sects;
+}
+
+/* Find sectors of a track and read them, by READ TRACK capture or by ID scan when it cannot be decoded */
+int readTrackScan(int dev, int cyl, int head, int enc, int trklen, struct track_buffer *tb, struct cylinder_cache *cc)
+{
+	int cnt;
+	int sects = 0;
+	long long rev;
+	long long now;
+	
+	if ((enc != -1) && ((optimize & OPTIMIZE_CAPTURE) != 0)) {
+		if ((sects = captureTrack(dev, head, enc, trklen, tb)) > 0) {
+			readTrackData(dev, head, tb);
+			return sects;
+		}
+		countRetry(RETRY_CAPTURE, 1);
+	}
+	memset(&tb->id, 0, sizeof(tb->id));
+	sects = 0;
+	if (enc != -1) {
+		/* Read sector sequence */
+		sects = readSectorSequence(dev, head, enc, 1, tb->id, tb->idTime, &tb->indexTime);
+	}
+	if (setTrackBuffer(tb, sects, enc) != 0) {
+		return -1;
+	}
+	/* Sequence could start after the ID read last, the head is past the ID of the latest time in the revolution */
+	if (sects > 1) {
+		rev = tb->idTime[sects] - tb->idTime[0];
+		now = fdcGetTime();
+		for (cnt = 1; cnt < sects; cnt++) {
+			if (((now - tb->idTime[cnt]) % rev + rev) % rev < ((now - tb->idTime[tb->located - 1]) % rev + rev) % rev) {
+				tb->located = cnt + 1;
+			}
+		}
+	}
+	readDumpTrack(dev, cyl, head, tb, cc);
+	return sects;
+}
+
+/* Read IDs of one revolution from any position, returns the located index of the track buffer when they are
+   its IDs and no more in the same physical order with their times set, -1: not as predicted */
+int verifyPrediction(int dev, int head, int enc, struct track_buffer *tb, int sects)
+{
+	int cnt;
+	int rot;
+	int idx;
+	long long rev;
+	long long time[MAXSECNUM + 1];
+	struct fdc_sector_id id[MAXSECNUM];
+	
+	if (readSectorSequence(dev, head, enc, 0, id, time, NULL) != sects) {
+		return -1;
+	}
+	/* ID read first is tb->id[rot] */
+	for (rot = 0; rot < sects; rot++) {
+		for (cnt = 0; cnt < sects; cnt++) {
+			if (memcmp(&id[cnt], &tb->id[(rot + cnt) % sects], sizeof(struct fdc_sector_id)) != 0) {
+				break;
+			}
+		}
+		if (cnt == sects) {
+			break;
+		}
+	}
+	if (rot == sects) {
+		return -1;
+	}
+	/* Times in the order of the track buffer, IDs before tb->id[0] come again one revolution later */
+	rev = time[sects] - time[0];
+	for (cnt = 0; cnt < sects; cnt++) {
+		idx = (cnt - rot + sects) % sects;
+		tb->idTime[cnt] = time[idx] + ((idx < (sects - rot) % sects) ? rev : 0);
+	}
+	tb->idTime[sects] = tb->idTime[0] + rev;
+	/* Sequence ended reading the first ID again */
+	return rot + 1;
+}
+
+/* Track can be the template of prediction, same C H N, no R twice and no sector error */
+int checkTrackRegular(struct track_buffer *tb)
+{
+	int cnt;
+	unsigned char seen[256];
+	
+	memset(seen, 0, sizeof(seen));
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		if ((tb->id[cnt].c != tb->id[0].c) || (tb->id[cnt].h != tb->id[0].h) || (tb->id[cnt].n != tb->id[0].n)
+			|| (seen[tb->id[cnt].r] != 0) || !ISSTATOK(tb->sec[cnt].bStatus)) {
+			return 0;
+		}
+		seen[tb->id[cnt].r] = 1;
+	}
+	return 1;
+}
+
+/* Count sectors whose ID was not found as predicted */
+int checkPrediction(struct track_buffer *tb)
+{
+	int cnt;
+	int miss = 0;
+	int code;
+	
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		code = convertStatus(&tb->res[cnt]);
+		if ((code == D88_STATUS_ND) || (code == D88_STATUS_MA) || (code == D88_STATUS_DE)
+			|| ((tb->res[cnt].st2 & (FDC_ST2_WC | FDC_ST2_BC)) != 0)) {
+			miss++;
+		}
+	}
+	return miss;
+}
+
+/* Write sectors one by one except flagged in skip, each result is stored to resbuf
+   Short sectors are padded in pad one after another, queued writes need it until submitted (NULL: on the stack) */
+int writeTrackSectors(int dev, int head, struct D88_SECTOR *secbuf, struct fdc_sector_id *idbuf, int sects,
+	unsigned char **data, unsigned char *skip, unsigned char *pad, struct fdc_res_cmd *resbuf)
+{
+	int cnt;
+	unsigned char *ptr;
+	unsigned char local[NSECSIZE(8)];
+	
+	for (cnt = 0; cnt < sects; cnt++) {
+		if ((skip != NULL) && (skip[cnt] != 0)) {
+			continue;
+		}
+		/* Short sector in the image, pad with zero up to the size of N */
+		ptr = data[cnt];
+		if (secbuf[cnt].wLength < NSECSIZE(idbuf[cnt].n)) {
+			ptr = (pad != NULL) ? pad : local;
+			memset(ptr, 0, NSECSIZE(idbuf[cnt].n));
+			memcpy(ptr, data[cnt], secbuf[cnt].wLength);
+			pad = (pad != NULL) ? pad + NSECSIZE(idbuf[cnt].n) : NULL;
+		}
+		if (fdcWriteData(dev, head, GETENCFDC(secbuf[cnt].bEncoding), &idbuf[cnt],
+			ISDAMDEL(secbuf[cnt].bDataAddressMark), ptr, &resbuf[cnt]) != 0) {
+			printf("fdcWriteData error\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write sector headers and data of a track with one vectored write */
+int writeTrackImage(int fd, struct track_buffer *tb)
+{
+	int cnt;
+	int iovcnt = 0;
+	ssize_t len;
+	struct iovec iov[MAXSECNUM * 2];
+	struct iovec *iovPtr = iov;
+	
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		iov[iovcnt].iov_base = &tb->sec[cnt];
+		iov[iovcnt++].iov_len = sizeof(struct D88_SECTOR);
+		iov[iovcnt].iov_base = tb->data[cnt];
+		iov[iovcnt++].iov_len = tb->sec[cnt].wLength;
+	}
+	while (iovcnt > 0) {
+		if ((len = writev(fd, iovPtr, iovcnt)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("writev");
+			return -1;
+		}
+		/* Skip vectors written, continue from the middle of partially written one */
+		while ((iovcnt > 0) && (len >= (ssize_t)iovPtr->iov_len)) {
+			len -= iovPtr->iov_len;
+			iovPtr++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iovPtr->iov_base = (unsigned char *)iovPtr->iov_base + len;
+			iovPtr->iov_len -= len;
+		}
+	}
+	return 0;
+}
+
+#define DUMPJNL_TITLE		"# fdm journal side:%d step:%d\n"
+#define DUMPJNL_FORMAT		"%d 0x%.8x 0x%.8x %d\n"
+
+/* Load completed tracks from dump journal, returns end offset of the last track */
+int loadDumpJournal(FILE *fj, int side, int mult, struct D88_HEADER *dsk, unsigned char *blankTrk, int *next)
+{
+	int trk;
+	int sects;
+	int jside;
+	int jmult;
+	unsigned int offset;
+	unsigned int end = sizeof(*dsk);
+	char line[128];
+	
+	if ((fgets(line, sizeof(line), fj) == NULL) || (sscanf(line, DUMPJNL_TITLE, &jside, &jmult) != 2)
+		|| (jside != side) || (jmult != mult)) {
+		printf("Journal does not match side and step\n");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fj) != NULL) {
+		if ((sscanf(line, "%d %x %x %d", &trk, &offset, &end, &sects) != 4) || (trk < 0) || (trk >= 164)) {
+			printf("Journal broken: %s", line);
+			return -1;
+		}
+		if (sects != 0) {
+			dsk->adwTrackOffsets[trk] = offset;
+		} else {
+			blankTrk[trk] = 1;
+		}
+		*next = trk + 1;
+	}
+	return end;
+}
+
+/* Writer thread, flushes track buffers in queued order */
+void *dumpWriter(void *arg)
+{
+	int ret;
+	struct dump_pipe *dp = arg;
+	struct track_buffer *tb;
+	
+	pthread_mutex_lock(&dp->lock);
+	for (;;) {
+		while ((dp->flushed == dp->filled) && (dp->closed == 0)) {
+			pthread_cond_wait(&dp->cond, &dp->lock);
+		}
+		if (dp->flushed == dp->filled) {
+			break;
+		}
+		pthread_mutex_unlock(&dp->lock);
+		tb = &dp->pool[dp->flushed % TRKPOOLNUM];
+		ret = writeTrackImage(dp->fd, tb);
+		/* Journal the track after its image reached the disk */
+		if ((ret == 0) && (fdatasync(dp->fd) == 0)) {
+			fprintf(dp->journal, DUMPJNL_FORMAT, tb->trk, tb->offset, tb->end, tb->sects);
+			fflush(dp->journal);
+		}
+		pthread_mutex_lock(&dp->lock);
+		if (ret != 0) {
+			dp->error = 1;
+		}
+		dp->flushed++;
+		pthread_cond_broadcast(&dp->cond);
+	}
+	pthread_mutex_unlock(&dp->lock);
+	return NULL;
+}
+
+/* Get the next track buffer to fill, waits while all buffers are queued */
+struct track_buffer *getTrackBuffer(struct dump_pipe *dp)
+{
+	struct track_buffer *tb = NULL;
+	
+	pthread_mutex_lock(&dp->lock);
+	while ((dp->filled - dp->flushed >= TRKPOOLNUM) && (dp->error == 0)) {
+		pthread_cond_wait(&dp->cond, &dp->lock);
+	}
+	if (dp->error == 0) {
+		tb = &dp->pool[dp->filled % TRKPOOLNUM];
+		/* Waited until the consumer released it */
+		fdcSyncTime(tb->time);
+	}
+	pthread_mutex_unlock(&dp->lock);
+	return tb;
+}
+
+/* Queue the filled track buffer to the writer thread */
+void putTrackBuffer(struct dump_pipe *dp)
+{
+	pthread_mutex_lock(&dp->lock);
+	dp->pool[dp->filled % TRKPOOLNUM].time = fdcGetTime();
+	dp->filled++;
+	pthread_cond_broadcast(&dp->cond);
+	pthread_mutex_unlock(&dp->lock);
+}
+
+/* Flush remaining track buffers and stop the writer thread */
+int closeDumpPipe(struct dump_pipe *dp, pthread_t writer)
+{
+	int cnt;
+	
+	pthread_mutex_lock(&dp->lock);
+	dp->closed = 1;
+	pthread_cond_broadcast(&dp->cond);
+	pthread_mutex_unlock(&dp->lock);
+	pthread_join(writer, NULL);
+	for (cnt = 0; cnt < TRKPOOLNUM; cnt++) {
+		free(dp->pool[cnt].buf);
+	}
+	return (dp->error == 0) ? 0 : -1;
+}
+
+#define RESCUEMAP_FORMAT	"%d %d %d 0x%.8x %.2X %.2X %.2X %.2X %.2X %.2X\n"
+
+/* Create rescue map file with its title line, or append to existing one */
+FILE *openRescueMap(char *mapname, int append)
+{
+	FILE *fm;
+	
+	if ((fm = fopen(mapname, (append != 0) ? "a" : "w")) == NULL) {
+		perror("fopen");
+		return NULL;
+	}
+	if (append == 0) {
+		fprintf(fm, "# track cylinder head offset C H R N encode status\n");
+	}
+	return fm;
+}
+
+/* Load failed sectors from rescue map file, returns number of entries */
+int loadRescueMap(char *mapname, struct rescue_entry *entry, int max)
+{
+	int num = 0;
+	unsigned int c, h, r, n;
+	char line[128];
+	FILE *fm;
+	
+	if ((fm = fopen(mapname, "r")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	while ((num < max) && (fgets(line, sizeof(line), fm) != NULL)) {
+		if (line[0] == '#') {
+			continue;
+		}
+		if (sscanf(line, "%d %d %d %x %x %x %x %x %x %x", &entry->trk, &entry->cyl, &entry->head, &entry->offset,
+			&c, &h, &r, &n, &entry->enc, &entry->status) != 10) {
+			continue;
+		}
+		entry->id.c = c;
+		entry->id.h = h;
+		entry->id.r = r;
+		entry->id.n = n;
+		entry++;
+		num++;
+	}
+	fclose(fm);
+	return num;
+}
+
+/* Save remaining failed sectors to rescue map file */
+int saveRescueMap(char *mapname, struct rescue_entry *entry, int num)
+{
+	FILE *fm;
+	
+	if ((fm = openRescueMap(mapname, 0)) == NULL) {
+		return -1;
+	}
+	for (; num > 0; num--, entry++) {
+		fprintf(fm, RESCUEMAP_FORMAT, entry->trk, entry->cyl, entry->head, entry->offset,
+			entry->id.c, entry->id.h, entry->id.r, entry->id.n, entry->enc, entry->status);
+	}
+	fclose(fm);
+	return 0;
+}
+
+/* Remove rescue map entries of the track and after */
+int trimRescueMap(char *mapname, int trk)
+{
+	int num;
+	int cnt;
+	int left = 0;
+	struct rescue_entry *entry;
+	
+	if ((entry = malloc(sizeof(*entry) * 164 * MAXSECNUM)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((num = loadRescueMap(mapname, entry, 164 * MAXSECNUM)) < 0) {
+		free(entry);
+		return -1;
+	}
+	for (cnt = 0; cnt < num; cnt++) {
+		if (entry[cnt].trk < trk) {
+			entry[left++] = entry[cnt];
+		}
+	}
+	num = saveRescueMap(mapname, entry, left);
+	free(entry);
+	return num;
+}
+
+#define TIMINGMAP_TITLE		"# fdm timing rev:%d length:%d\n"
+#define TIMINGMAP_FORMAT	"%d %.2X %.2X %.2X %.2X %.2X %d\n"
+
+/* Sector ID and its angular position in timing map */
+struct timing_entry {
+	int trk;
+	struct fdc_sector_id id;
+	int enc;
+	int pos;								/* Time from the index to the end of the ID field [usec] */
+};
+
+/* Timing map of a disk, entries of each track in physical order */
+struct timing_map {
+	int rev;								/* Revolution time [usec] */
+	int trklen;								/* MFM track length [bytes] */
+	int num;
+	struct timing_entry *entry;
+};
+
+FILE *openTimingMap(char *timename, int append, int rev, int trklen)
+{
+	FILE *ft;
+	
+	if ((ft = fopen(timename, (append != 0) ? "a" : "w")) == NULL) {
+		perror("fopen");
+		return NULL;
+	}
+	if (append == 0) {
+		fprintf(ft, TIMINGMAP_TITLE, rev, trklen);
+		fprintf(ft, "# track C H R N encode position[usec]\n");
+	}
+	return ft;
+}
+
+/* Load timing map file, returns number of entries */
+int loadTimingMap(char *timename, struct timing_map *tm)
+{
+	unsigned int c, h, r, n;
+	char line[128];
+	struct timing_entry *entry;
+	FILE *ft;
+	
+	memset(tm, 0, sizeof(*tm));
+	if ((tm->entry = malloc(sizeof(*tm->entry) * 164 * MAXSECNUM)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((ft = fopen(timename, "r")) == NULL) {
+		perror("fopen");
+		free(tm->entry);
+		return -1;
+	}
+	while ((tm->num < 164 * MAXSECNUM) && (fgets(line, sizeof(line), ft) != NULL)) {
+		if (line[0] == '#') {
+			sscanf(line, TIMINGMAP_TITLE, &tm->rev, &tm->trklen);
+			continue;
+		}
+		entry = &tm->entry[tm->num];
+		if ((sscanf(line, "%d %x %x %x %x %x %d", &entry->trk, &c, &h, &r, &n, &entry->enc, &entry->pos) != 7)
+			|| (entry->trk < 0) || (entry->trk >= 164)) {
+			continue;
+		}
+		entry->id.c = c;
+		entry->id.h = h;
+		entry->id.r = r;
+		entry->id.n = n;
+		tm->num++;
+	}
+	fclose(ft);
+	if ((tm->rev <= 0) || (tm->trklen <= 0)) {
+		fprintf(stderr, "%s: no revolution time in timing map\n", timename);
+		free(tm->entry);
+		return -1;
+	}
+	return tm->num;
+}
+
+/* Remove timing map entries of the track and after */
+int trimTimingMap(char *timename, int trk)
+{
+	int cnt;
+	struct timing_map tm;
+	struct timing_entry *entry;
+	FILE *ft;
+	
+	if (loadTimingMap(timename, &tm) < 0) {
+		return -1;
+	}
+	if ((ft = openTimingMap(timename, 0, tm.rev, tm.trklen)) == NULL) {
+		free(tm.entry);
+		return -1;
+	}
+	for (cnt = 0; cnt < tm.num; cnt++) {
+		entry = &tm.entry[cnt];
+		if (entry->trk < trk) {
+			fprintf(ft, TIMINGMAP_FORMAT, entry->trk, entry->id.c, entry->id.h, entry->id.r, entry->id.n,
+				entry->enc, entry->pos);
+		}
+	}
+	fclose(ft);
+	free(tm.entry);
+	return 0;
+}
+
+/* Write angular positions of the sector IDs, they are sampled again when not timed from the index */
+int writeTrackTiming(FILE *ft, int dev, int trk, int head, struct track_buffer *tb)
+{
+	int cnt;
+	int idx;
+	int sects = tb->sects;
+	int rev = fdcGetRevTime();
+	long long index = tb->indexTime;
+	long long *timebuf = tb->idTime;
+	long long time[MAXSECNUM + 1];
+	struct fdc_sector_id *idbuf = tb->id;
+	struct fdc_sector_id id[MAXSECNUM];
+	struct timing_entry entry[MAXSECNUM];
+	
+	if (sects == 0) {
+		return 0;
+	}
+	if (index < 0) {
+		sects = readSectorSequence(dev, head, tb->enc, 1, id, time, &index);
+		if ((sects == 0) || (index < 0)) {
+			printf("[Timing] Not sampled\n");
+			return 0;
+		}
+		idbuf = id;
+		timebuf = time;
+	}
+	/* Sort by position, the first ID read could be past the index */
+	for (cnt = 0; cnt < sects; cnt++) {
+		for (idx = cnt; (idx > 0) && (entry[idx - 1].pos > (timebuf[cnt] - index) % rev); idx--) {
+			entry[idx] = entry[idx - 1];
+		}
+		entry[idx].id = idbuf[cnt];
+		entry[idx].pos = (timebuf[cnt] - index) % rev;
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		fprintf(ft, TIMINGMAP_FORMAT, trk, entry[cnt].id.c, entry[cnt].id.h, entry[cnt].id.r, entry[cnt].id.n,
+			tb->enc, entry[cnt].pos);
+	}
+	fflush(ft);
+	printf("[Timing] Sectors:%d / First:%.2X / Position:%d\n", sects, entry[0].id.r, entry[0].pos);
+	return sects;
+}
+
+/* Initialize the reader of tracks from a drive */
+void initTrackReader(struct track_reader *rd, int dev, int mult, int side, int trklen)
+{
+	memset(rd, 0, sizeof(*rd));
+	rd->dev = dev;
+	rd->mult = mult;
+	rd->trklen = trklen;
+	rd->expect = D88_ENCODE_MFM;
+	if ((side == 2) && ((optimize & OPTIMIZE_MT) != 0)) {
+		rd->ccPtr = &rd->cc;
+	}
+}
+
+/* Set D88 sector headers of the track read */
+void setTrackSectors(struct track_buffer *tb)
+{
+	int cnt;
+	struct D88_SECTOR *sec;
+	
+	for (cnt = 0; cnt < tb->sects; cnt++) {
+		sec = &tb->sec[cnt];
+		memset(sec, 0, sizeof(*sec));
+		memcpy(&sec->c, &tb->id[cnt], sizeof(struct fdc_sector_id));
+		sec->wSectors = tb->sects;
+		sec->bEncoding = tb->enc;
+		sec->wLength = NSECSIZE(tb->id[cnt].n) ;
+		sec->bStatus = convertStatus(&tb->res[cnt]);
+		sec->bDataAddressMark = (sec->bStatus & D88_STATUS_CM) ? D88_DAM_DELETED : D88_DAM_NORMAL;
+	}
+}
+
+/* Seek and read a track with enabled optimize modes, returns the number of sectors */
+int readFloppyTrack(struct track_reader *rd, int cyl, int head, struct track_buffer *tb)
+{
+	int cnt;
+	int enc;
+	int sects;
+	int located;
+	struct fdc_res_intr intr;
+	struct fdc_res_cmd idres;
+	struct track_predict *pred = &rd->predict[head & 1];
+	
+	sects = 0;
+	memset(&tb->id, 0, sizeof(tb->id));
+	tb->indexTime = -1;
+	/* READ TRACK returns the IDs with the data in one revolution, predicted tracks are captured as well */
+	if (((optimize & OPTIMIZE_PREDICT) != 0) && ((optimize & OPTIMIZE_CAPTURE) == 0) && (pred->sects != 0)) {
+		/* Seek floppy and expect the same geometry as the previous track */
+		if (fdcSeek(rd->dev, cyl * rd->mult, &intr) != 0) {
+			printf("fdcSeek error\n");
+			return -1;
+		}
+		enc = pred->enc;
+		sects = pred->sects;
+		for (cnt = 0; cnt < sects; cnt++) {
+			tb->id[cnt] = pred->id[cnt];
+			tb->id[cnt].c += cyl - pred->cyl;
+		}
+		/* IDs of one revolution must be the predicted ones and no more, then read data */
+		if ((located = verifyPrediction(rd->dev, head, enc, tb, sects)) > 0) {
+			if (setTrackBuffer(tb, sects, enc) != 0) {
+				return -1;
+			}
+			tb->located = located;
+			readDumpTrack(rd->dev, cyl, head, tb, rd->ccPtr);
+		}
+		if ((located > 0) && (checkPrediction(tb) == 0)) {
+			printf("[Predict] Sectors:%d\n", sects);
+		} else {
+			/* Verify encoding with one READ ID and scan the track */
+			printf("[Predict] Mismatch\n");
+			countRetry(RETRY_PREDICT, 1);
+			sects = 0;
+			memset(&tb->id, 0, sizeof(tb->id));
+			fdcReadId(rd->dev, head, GETENCFDC(enc), &idres);
+			if (convertStatus(&idres) != 0) {
+				enc = detectTrackEncoding(rd->dev, head, enc);
+			}
+			if ((sects = readTrackScan(rd->dev, cyl, head, enc, rd->trklen, tb, rd->ccPtr)) < 0) {
+				return -1;
+			}
+		}
+	} else {
+		/* Seek floppy and check track encoding */
+		if ((optimize & OPTIMIZE_BATCH) != 0) {
+			if ((enc = seekTrackEncoding(rd->dev, cyl * rd->mult, head, rd->expect)) == -2) {
+				printf("fdcSeek error\n");
+				return -1;
+			}
+		} else {
+			if (fdcSeek(rd->dev, cyl * rd->mult, &intr) != 0) {
+				printf("fdcSeek error\n");
+				return -1;
+			}
+			enc = detectTrackEncoding(rd->dev, head, rd->expect);
+		}
+		if ((sects = readTrackScan(rd->dev, cyl, head, enc, rd->trklen, tb, rd->ccPtr)) < 0) {
+			return -1;
+		}
+	}
+	setTrackSectors(tb);
+	/* Keep geometry for the next track of this side, an irregular or protected track is not the template */
+	pred->cyl = cyl;
+	pred->enc = enc;
+	pred->sects = (checkTrackRegular(tb) != 0) ? sects : 0;
+	memcpy(pred->id, tb->id, sizeof(pred->id));
+	if (sects != 0) {
+		rd->expect = enc;
+	}
+	return sects;
+}
+
+int dumpFloppyDisk(int start, int end, int mult, int side, int media, int protect, int cutoff, int resume,
+	int trklen, char *filename, char *mapname, char *timename, struct dump_stats *stats)
+{
+	int trk;
+	int cyl;
+	int head;
+	int sects;
+	int cnt;
+	int offset;
+	int enc;
+	int errors;
+	int blankCyl = 0;
+	int blankHead;
+	unsigned char blankTrk[164];
+	unsigned char skipTrk[164];
+	int ret = -1;
+	unsigned char *data;
+	long long startTime;
+	long long trackTime;
+	int firstHead;
+	FILE *fm = NULL;
+	FILE *ft = NULL;
+	char tmpname[PATH_MAX];
+	char jnlname[PATH_MAX];
+	
+	pthread_t writer;
+	struct dump_pipe dp;
+	struct D88_HEADER dsk;
+	struct D88_SECTOR *sec;
+	struct fdc_res_cmd *res;
+	struct track_buffer *tb;
+	struct track_reader rd;
+	struct track_stats ts;
+	struct dump_stats st;
+	
+	printf("Dump Started\n");
+	printf("*Cylinder   : %d - %d\n", start, end);
+	printf("*Step       : %d\n", mult);
+	printf("*Side       : %d\n", side);
+	printf("*MediaType  : %.2x\n", media);
+	printf("*WiteProtect: %.2x\n", protect);
+	printf("*Filename   : %s\n", filename);
+	startTime = fdcGetTime();
+
+	/* Dump into temporary image with journal, renamed when completed */
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	snprintf(jnlname, sizeof(jnlname), "%s.jnl", filename);
+	memset(&dp, 0, sizeof(dp));
+	memset(&st, 0, sizeof(st));
+	memset(&dsk, 0, sizeof(dsk));
+	memset(blankTrk, 0, sizeof(blankTrk));
+	memset(skipTrk, 0, sizeof(skipTrk));
+	dsk.bMediaType = media;
+	dsk.bWriteProtect = protect;
+	trk = (side == 2) ? start * 2: start;
+	offset = sizeof(dsk);
+	
+	if (resume != 0) {
+		/* Continue from the track next to the last journaled one */
+		if ((dp.journal = fopen(jnlname, "r+")) == NULL) {
+			perror("fopen");
+			return -1;
+		}
+		if ((offset = loadDumpJournal(dp.journal, side, mult, &dsk, blankTrk, &trk)) < 0) {
+			fclose(dp.journal);
+			return -1;
+		}
+		if ((dp.fd = open(tmpname, O_WRONLY)) < 0) {
+			perror("open");
+			fclose(dp.journal);
+			return -1;
+		}
+		if ((ftruncate(dp.fd, offset) != 0) || (lseek(dp.fd, offset, SEEK_SET) != offset)) {
+			perror("ftruncate");
+			close(dp.fd);
+			fclose(dp.journal);
+			return -1;
+		}
+		printf("*Resume     : Track %d / Offset: 0x%.8x\n", trk, offset);
+	} else {
+		/* Open(write) disk image file and journal */
+		if ((dp.fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+			perror("open");
+			return -1;
+		}
+		if ((dp.journal = fopen(jnlname, "w")) == NULL) {
+			perror("fopen");
+			close(dp.fd);
+			return -1;
+		}
+		fprintf(dp.journal, DUMPJNL_TITLE, side, mult);
+		fflush(dp.journal);
+		
+		/* Write disk image header */
+		if (write(dp.fd, &dsk, sizeof(dsk)) != sizeof(dsk)) {
+			perror("write");
+			close(dp.fd);
+			fclose(dp.journal);
+			return -1;
+		}
+	}
+	
+	/* Open(write) rescue map file, append to the interrupted one without tracks dumped again */
+	if ((mapname != NULL) && (resume != 0) && (trimRescueMap(mapname, trk) != 0)) {
+		close(dp.fd);
+		fclose(dp.journal);
+		return -1;
+	}
+	if ((mapname != NULL) && ((fm = openRescueMap(mapname, resume)) == NULL)) {
+		close(dp.fd);
+		fclose(dp.journal);
+		return -1;
+	}
+	/* Open(write) timing map file the same way */
+	if ((timename != NULL) && (resume != 0) && (trimTimingMap(timename, trk) != 0)) {
+		close(dp.fd);
+		fclose(dp.journal);
+		return -1;
+	}
+	if ((timename != NULL) && ((ft = openTimingMap(timename, resume, fdcGetRevTime(), trklen)) == NULL)) {
+		close(dp.fd);
+		fclose(dp.journal);
+		return -1;
+	}
+	initTrackReader(&rd, FD_DEVNUM, mult, side, trklen);
+	
+	/* Start image writer thread with preallocated track buffers */
+	for (cnt = 0; cnt < TRKPOOLNUM; cnt++) {
+		if ((dp.pool[cnt].buf = malloc(TRKBUFLEN)) == NULL) {
+			perror("malloc");
+			close(dp.fd);
+			fclose(dp.journal);
+			return -1;
+		}
+		dp.pool[cnt].bufSize = TRKBUFLEN;
+	}
+	pthread_mutex_init(&dp.lock, NULL);
+	pthread_cond_init(&dp.cond, NULL);
+	if (pthread_create(&writer, NULL, dumpWriter, &dp) != 0) {
+		perror("pthread_create");
+		close(dp.fd);
+		fclose(dp.journal);
+		return -1;
+	}
+	
+	/* Read tracks from floppy disk */
+	start = (side == 2) ? trk / 2 : trk;
+	firstHead = (side == 2) ? trk % 2 : side;
+	for (cyl = start; cyl <= end; cyl++) {
+		/* Stop after consecutive blank cylinders, the rest are skipped */
+		if ((cutoff > 0) && (blankCyl >= cutoff)) {
+			printf("\n[Cutoff] Blank cylinders:%d / Skip cylinder:%d - %d\n", blankCyl, cyl, end);
+			for (; cyl <= end; cyl++) {
+				for (head = (side == 2) ? 0 : side; (head < ((side == 2) ? 2 : side + 1)) && (trk < 164); head++) {
+					skipTrk[trk++] = 1;
+				}
+			}
+			break;
+		}
+		blankHead = 0;
+		for (head = (cyl == start) ? firstHead : (side == 2) ? 0 : side; (head < ((side == 2) ? 2 : side + 1)) && (trk < 164); head++) {
+			printf("\nTrack: %d / Offset: 0x%.8x\n", trk, offset);
+			printf("[Seek] Cylinder:%d / Step:%d\n", cyl, mult);
+			
+			if ((tb = getTrackBuffer(&dp)) == NULL) {
+				goto finish;
+			}
+			tb->trk = trk;
+			tb->offset = offset;
+			trackTime = fdcGetTime();
+			beginTrackStats(&ts);
+			if ((sects = readFloppyTrack(&rd, cyl, head, tb)) < 0) {
+				goto finish;
+			}
+			enc = tb->enc;
+			errors = 0;
+			if (sects != 0) {
+				/* Set track image address */
+				dsk.adwTrackOffsets[trk] = offset;
+			} else {
+				blankTrk[trk] = 1;
+				blankHead++;
+				st.blank++;
+			}
+			st.tracks++;
+			st.sectors += sects;
+			printf("[ReadData] Side:%d / Encode:%.2X / Sectors:%d\n", head, enc, sects);
+			if (verbose != 0) {
+				printf(" C  H  R  N  : RESULT CODE   : DATA\n");
+			}
+			for (cnt = 0; cnt < sects; cnt++) {
+				sec = &tb->sec[cnt];
+				data = tb->data[cnt];
+				res = &tb->res[cnt];
+				if (verbose != 0) {
+					printf(" %.2X %.2X %.2X %.2X : %.2X (%.2X %.2X %.2X) : %.2X\n",
+						sec->c, sec->h, sec->r, sec->n, sec->bStatus, res->st0, res->st1, res->st2, data[0]);
+				}
+				/* Log failed sector */
+				errors += !ISSTATOK(sec->bStatus);
+				if ((fm != NULL) && !ISSTATOK(sec->bStatus)) {
+					fprintf(fm, RESCUEMAP_FORMAT, trk, cyl, head, offset, sec->c, sec->h, sec->r, sec->n, enc, sec->bStatus);
+				}
+				offset += sizeof(*sec) + sec->wLength;
+			}
+			if (fm != NULL) {
+				fflush(fm);
+			}
+			/* Record sector positions while the head is on the track */
+			if (ft != NULL) {
+				writeTrackTiming(ft, rd.dev, trk, head, tb);
+			}
+			st.errors += errors;
+			/* Write track image on writer thread */
+			tb->end = offset;
+			putTrackBuffer(&dp);
+			endTrackStats(&ts, "dump", FD_DEVNUM, trk, sects, errors);
+			printf("[Result] Revolutions:%.2f\n", (double)(fdcGetTime() - trackTime) / fdcGetRevTime());
+			trk++;
+		}
+		blankCyl = (blankHead == ((side == 2) ? 2 : 1)) ? blankCyl + 1 : 0;
+	}
+	dsk.dwDiskSize = offset;
+	ret = 0;
+	
+finish:
+	if (closeDumpPipe(&dp, writer) != 0) {
+		ret = -1;
+	}
+	if ((ret == 0) && ((pwrite(dp.fd, &dsk, sizeof(dsk), 0) != sizeof(dsk)) || (fsync(dp.fd) != 0))) {
+		perror("pwrite");
+		ret = -1;
+	}
+	close(dp.fd);
+	fclose(dp.journal);
+	if (fm != NULL) {
+		fclose(fm);
+	}
+	if (ft != NULL) {
+		fclose(ft);
+	}
+	/* Replace the image with completed one, journal is kept to resume on error */
+	if ((ret == 0) && (rename(tmpname, filename) != 0)) {
+		perror("rename");
+		ret = -1;
+	}
+	if (ret != 0) {
+		return -1;
+	}
+	unlink(jnlname);
+	printElapsed(startTime);
+	if (stats != NULL) {
+		st.disks = 1;
+		st.time = fdcGetTime() - startTime;
+		*stats = st;
+	}
+	printTrackList("*BlankTrack ", blankTrk, sizeof(blankTrk));
+	printTrackList("*SkipTrack  ", skipTrk, sizeof(skipTrk));
+	printf("Dump Ended\n");
+	return 0;
+}
+
+/* Update sector header and data in the image with a clean read */
+int updateRescueSector(int fd, struct rescue_entry *entry, int status, unsigned char *data)
+{
+	struct D88_SECTOR sec;
+	
+	if (pread(fd, &sec, sizeof(sec), entry->offset) != sizeof(sec)) {
+		perror("pread");
+		return -1;
+	}
+	if (memcmp(&sec.c, &entry->id, sizeof(entry->id)) != 0) {
+		printf("Sector header mismatch at 0x%.8x\n", entry->offset);
+		return -1;
+	}
+	sec.bStatus = status;
+	sec.bDataAddressMark = (status & D88_STATUS_CM) ? D88_DAM_DELETED : D88_DAM_NORMAL;
+	if ((pwrite(fd, data, sec.wLength, entry->offset + sizeof(sec)) != sec.wLength)
+		|| (pwrite(fd, &sec, sizeof(sec), entry->offset) != sizeof(sec))) {
+		perror("pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+/* Retry failed sectors listed in the rescue map, seeking from alternate directions on each pass,
+   returns sectors still failed */
+int rescueFloppyDisk(int end, int mult, int passes, char *filename, char *mapname)
+{
+	int fd;
+	int num;
+	int left;
+	int pass;
+	int cnt;
+	int retry;
+	int from;
+	int status;
+	int lastCyl;
+	long long startTime;
+	unsigned char data[NSECSIZE(8)];
+	struct rescue_entry *entry;
+	struct fdc_res_cmd res;
+	struct fdc_res_intr intr;
+	
+	printf("\nRescue Started\n");
+	printf("*Passes     : %d\n", passes);
+	printf("*Mapfile    : %s\n", mapname);
+	startTime = fdcGetTime();
+	
+	if ((entry = malloc(sizeof(*entry) * 164 * MAXSECNUM)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((num = loadRescueMap(mapname, entry, 164 * MAXSECNUM)) < 0) {
+		free(entry);
+		return -1;
+	}
+	if ((fd = open(filename, O_RDWR)) < 0) {
+		perror("open");
+		free(entry);
+		return -1;
+	}
+	
+	for (pass = 1; (pass <= passes) && (num != 0); pass++) {
+		printf("\nPass: %d / Sectors:%d\n", pass, num);
+		lastCyl = -1;
+		left = 0;
+		for (cnt = 0; cnt < num; cnt++) {
+			/* Approach the cylinder from inner side (higher cylinder) on odd pass and outer side on even pass,
+			   the other side when it is past the first or last cylinder */
+			if (entry[cnt].cyl != lastCyl) {
+				from = entry[cnt].cyl + ((pass & 1) ? pass : -pass);
+				from = (from < 0) ? entry[cnt].cyl + pass : (from > end) ? entry[cnt].cyl - pass : from;
+				from = (from < 0) ? 0 : (from > end) ? end : from;
+				printf("[Seek] Cylinder:%d -> %d / Step:%d\n", from, entry[cnt].cyl, mult);
+				if ((fdcSeek(FD_DEVNUM, from * mult, &intr) != 0) || (fdcSeek(FD_DEVNUM, entry[cnt].cyl * mult, &intr) != 0)) {
+					printf("fdcSeek error\n");
+					break;
+				}
+				lastCyl = entry[cnt].cyl;
+			}
+			/* Read repeatedly until a clean read arrives */
+			status = entry[cnt].status;
+			for (retry = 0; retry < RESCUEREAD; retry++) {
+				countRetry(RETRY_RESCUE, 1);
+				if (fdcReadData(FD_DEVNUM, entry[cnt].head, GETENCFDC(entry[cnt].enc), &entry[cnt].id, 0, data, &res) != 0) {
+					printf("fdcReadData error\n");
+					continue;
+				}
+				status = convertStatus(&res);
+				if (ISSTATOK(status)) {
+					break;
+				}
+			}
+			printf(" %.2X %.2X %.2X %.2X : %.2X -> %.2X\n", entry[cnt].id.c, entry[cnt].id.h, entry[cnt].id.r, entry[cnt].id.n,
+				entry[cnt].status, status);
+			if (ISSTATOK(status) && (updateRescueSector(fd, &entry[cnt], status, data) == 0)) {
+				continue;
+			}
+			entry[cnt].status = status;
+			entry[left++] = entry[cnt];
+		}
+		/* Keep the sectors not tried when aborted */
+		for (; cnt < num; cnt++) {
+			entry[left++] = entry[cnt];
+		}
+		num = left;
+		saveRescueMap(mapname, entry, num);
+	}
+	close(fd);
+	free(entry);
+	printElapsed(startTime);
+	printf("*Remaining  : %d\n", num);
+	printf("Rescue Ended\n");
+	return num;
+}
+
+/* Verify written sectors, flag failed ones and return the number of them */
+int verifyTrackSectors(int dev, int head, struct D88_SECTOR *secbuf, struct fdc_sector_id *idbuf, int sects,
+	unsigned char *failed)
+{
+	int cnt;
+	int first = 0;
+	int num = 0;
+	struct fdc_sector_id id;
+	struct fdc_res_cmd res;
+	struct fdc_res_cmd resBuf[MAXSECNUM];
+	
+	memset(failed, 0, sects);
+	if (((optimize & OPTIMIZE_MULTI) != 0) && (checkSectorRun(secbuf, sects) != 0)) {
+		/* Verify whole R run at once, restart after the sector reported an error */
+		memcpy(&id, &idbuf[0], sizeof(id));
+		while (first < sects) {
+			id.r = idbuf[first].r;
+			if (fdcVerifyMulti(dev, head, GETENCFDC(secbuf[0].bEncoding), &id, idbuf[sects - 1].r, &res) != 0) {
+				memset(failed + first, 1, sects - first);
+				break;
+			}
+			if (convertStatus(&res) == 0) {
+				break;
+			}
+			if ((res.r < id.r) || (res.r > idbuf[sects - 1].r)) {
+				memset(failed + first, 1, sects - first);
+				break;
+			}
+			failed[res.r - idbuf[0].r] = 1;
+			first = res.r - idbuf[0].r + 1;
+		}
+	} else {
+		/* Verify one by one, as one command chain if enabled */
+		memset(resBuf, 0, sizeof(resBuf));
+		if ((optimize & OPTIMIZE_BATCH) != 0) {
+			fdcBatchBegin();
+		}
+		for (cnt = 0; cnt < sects; cnt++) {
+			if (fdcVerify(dev, head, GETENCFDC(secbuf[cnt].bEncoding), &idbuf[cnt], &resBuf[cnt]) != 0) {
+				failed[cnt] = 1;
+			}
+		}
+		if (((optimize & OPTIMIZE_BATCH) != 0) && (fdcBatchSubmit(dev) != 0)) {
+			memset(failed, 1, sects);
+		}
+		for (cnt = 0; cnt < sects; cnt++) {
+			if (convertStatus(&resBuf[cnt]) != (ISDAMDEL(secbuf[cnt].bDataAddressMark) ? D88_STATUS_CM : 0x00)) {
+				failed[cnt] = 1;
+			}
+		}
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		num += failed[cnt];
+	}
+	return num;
+}
+
+/* Verify the track just written and rewrite failed sectors, returns the number of sectors still failed */
+int verifyTrack(int dev, int head, struct D88_SECTOR *secbuf, struct fdc_sector_id *idbuf, int sects,
+	unsigned char **data, int *rewrite)
+{
+	int cnt;
+	int num;
+	int retry;
+	unsigned char failed[MAXSECNUM];
+	unsigned char skip[MAXSECNUM];
+	struct fdc_res_cmd resBuf[MAXSECNUM];
+	
+	for (retry = 0; ; retry++) {
+		num = verifyTrackSectors(dev, head, secbuf, idbuf, sects, failed);
+		printf("[Verify] Side:%d / Sectors:%d / Failed:%d\n", head, sects, num);
+		if ((num == 0) || (retry >= VERIFYRETRY)) {
+			break;
+		}
+		/* Rewrite failed sectors only */
+		for (cnt = 0; cnt < sects; cnt++) {
+			skip[cnt] = !failed[cnt];
+		}
+		if (writeTrackSectors(dev, head, secbuf, idbuf, sects, data, skip, NULL, resBuf) != 0) {
+			break;
+		}
+		*rewrite += num;
+		countRetry(RETRY_REWRITE, num);
+	}
+	return num;
+}
+
+/* Get the byte value if data is filled with it, or -1 */
+int getFillPattern(unsigned char *data, int len)
+{
+	/* Compare with itself shifted by one byte, runs on vector instructions of memcmp */
+	if ((len > 0) && (memcmp(data, data + 1, len - 1) == 0)) {
+		return data[0];
+	}
+	return -1;
+}
+
+/* Choose the fill byte of most uniform sectors formatted as is, flag them in filled and return the byte */
+int setFillSectors(struct D88_SECTOR *secbuf, int sects, unsigned char **data, unsigned char *filled)
+{
+	int cnt;
+	int ptn[MAXSECNUM];
+	int count[256];
+	int fill = 0x00;
+	
+	memset(count, 0, sizeof(count));
+	for (cnt = 0; cnt < sects; cnt++) {
+		ptn[cnt] = -1;
+		if ((secbuf[cnt].n == secbuf[0].n) && (secbuf[cnt].bEncoding == secbuf[0].bEncoding)
+			&& (secbuf[cnt].wLength == NSECSIZE(secbuf[0].n)) && !ISDAMDEL(secbuf[cnt].bDataAddressMark)
+			&& ((ptn[cnt] = getFillPattern(data[cnt], secbuf[cnt].wLength)) >= 0)) {
+			count[ptn[cnt]]++;
+			fill = (count[ptn[cnt]] > count[fill]) ? ptn[cnt] : fill;
+		}
+	}
+	for (cnt = 0; cnt < sects; cnt++) {
+		filled[cnt] = (ptn[cnt] == fill);
+	}
+	return fill;
+}
+
+/* Compare track on floppy with the image, returns 0 if same, 1 if flagged sectors differ, 2 if format differs */
+int compareTrack(int dev, int head, struct D88_SECTOR *secbuf, struct fdc_sector_id *idbuf, int sects,
+	unsigned char **data, struct track_buffer *tb, unsigned char *differ)
+{
+	int cnt;
+	int num;
+	int rot;
+	int idx;
+	int len;
+	int code;
+	int ret = 0;
+	
+	/* Unformat track expected */
+	if (sects == 0) {
+		return (probeTrackEncoding(dev, head, D88_ENCODE_MFM) == -1) ? 0 : 2;
+	}
+	/* Find the image ID sequence in the IDs on floppy, any start position */
+	if ((num = readSectorSequence(dev, head, secbuf[0].bEncoding, 0, tb->id, tb->idTime, NULL)) != sects) {
+		return 2;
+	}
+	for (rot = 0; rot < num; rot++) {
+		for (cnt = 0; cnt < num; cnt++) {
+			if (memcmp(&tb->id[(rot + cnt) % num], &idbuf[cnt], sizeof(struct fdc_sector_id)) != 0) {
+				break;
+			}
+		}
+		if (cnt == num) {
+			break;
+		}
+	}
+	if (rot == num) {
+		return 2;
+	}
+	/* Read sectors and compare data and deleted mark */
+	if (setTrackBuffer(tb, num, secbuf[0].bEncoding) != 0) {
+		return 2;
+	}
+	readTrackData(dev, head, tb);
+	for (cnt = 0; cnt < sects; cnt++) {
+		idx = (rot + cnt) % num;
+		len = (secbuf[cnt].wLength < NSECSIZE(idbuf[cnt].n)) ? secbuf[cnt].wLength : NSECSIZE(idbuf[cnt].n);
+		code = convertStatus(&tb->res[idx]);
+		differ[cnt] = (code != (ISDAMDEL(secbuf[cnt].bDataAddressMark) ? D88_STATUS_CM : 0x00))
+			|| (memcmp(tb->data[idx], data[cnt], len) != 0);
+		ret |= differ[cnt];
+	}
+	return ret;
+}
+
+/* Plan format parameters and write groups of a track */
+int compileTrackPlan(struct track_plan *plan, int sects, struct D88_SECTOR *sec, unsigned char **data, int trklen)
+{
+	int cnt;
+	int runLen = 0;
+	struct write_group *group;
+	
+	plan->sects = sects;
+	plan->fill = 0x00;
+	memset(plan->filled, 0, sizeof(plan->filled));
+	if (plan->sects == 0) {
+		/* Unformat with one sector larger than the track */
+		plan->enc = D88_ENCODE_MFM;
+		plan->n = calcUnformatSizeNum(trklen, plan->enc);
+		plan->count = 1;
+		plan->gap3 = 0;
+		plan->pending = 0;
+		plan->groups = 0;
+		plan->padLen = 0;
+		plan->sec = NULL;
+		plan->data = NULL;
+		memset(plan->id, 0, sizeof(plan->id));
+		plan->id[0].n = plan->n;
+		return 0;
+	}
+	plan->sec = sec;
+	plan->data = data;
+	plan->enc = sec[0].bEncoding;
+	plan->n = sec[0].n;
+	plan->count = sec[0].wSectors;
+	plan->gap3 = calcFormatGapLen(trklen, plan->n, plan->count, plan->enc);
+	if (plan->gap3 <= 0) {
+		printf("Track %d: %d sectors of N=%.2X exceed track length %d\n", plan->trk, plan->count, plan->n, trklen);
+		return -1;
+	}
+	plan->padLen = 0;
+	for (cnt = 0; cnt < plan->sects; cnt++) {
+		memcpy(&plan->id[cnt], &sec[cnt].c, sizeof(struct fdc_sector_id));
+		if (sec[cnt].wLength < NSECSIZE(sec[cnt].n)) {
+			plan->padLen += NSECSIZE(sec[cnt].n);
+		}
+		if ((sec[cnt].bEncoding != plan->enc) || (sec[cnt].n != plan->n)) {
+			printf("Track %d: sector %.2X formatted as Encode:%.2X N:%.2X\n", plan->trk, sec[cnt].r, plan->enc, plan->n);
+		}
+	}
+	/* Format with the fill byte of uniform sectors and skip writing them */
+	if ((optimize & OPTIMIZE_FILL) != 0) {
+		plan->fill = setFillSectors(sec, plan->sects, data, plan->filled);
+	}
+	/* Group sectors to write, R runs in physical order are written at once */
+	plan->pending = 0;
+	plan->groups = 0;
+	for (cnt = 0; cnt < plan->sects; cnt++) {
+		if (plan->filled[cnt] != 0) {
+			continue;
+		}
+		plan->pending++;
+		if (((optimize & OPTIMIZE_MULTI) != 0) && (plan->groups != 0)) {
+			group = &plan->group[plan->groups - 1];
+			if ((group->first + group->count == cnt) && (checkSectorRun(&sec[group->first], group->count + 1) != 0)) {
+				group->count++;
+				continue;
+			}
+		}
+		plan->group[plan->groups].first = cnt;
+		plan->group[plan->groups].count = 1;
+		plan->groups++;
+	}
+	/* Transfer buffer must hold all runs of the track, or write one by one */
+	for (cnt = 0; cnt < plan->groups; cnt++) {
+		if (plan->group[cnt].count > 1) {
+			runLen += sec[plan->group[cnt].first].wLength * plan->group[cnt].count;
+		}
+	}
+	if (runLen > MAXTRKLEN) {
+		plan->groups = 0;
+		for (cnt = 0; cnt < plan->sects; cnt++) {
+			if (plan->filled[cnt] == 0) {
+				plan->group[plan->groups].first = cnt;
+				plan->group[plan->groups].count = 1;
+				plan->groups++;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Compile restore plan of all tracks in range, returns the number of tracks */
+int compileRestorePlan(struct track_plan **planPtr, struct d88_image *img, int start, int end, int side, int trklen)
+{
+	int cyl;
+	int head;
+	int num = 0;
+	int heads = (side == 2) ? 2 : 1;
+	struct track_plan *plan;
+	
+	if ((end < start) || ((plan = malloc(sizeof(*plan) * (end - start + 1) * heads)) == NULL)) {
+		printf("No track to restore\n");
+		return -1;
+	}
+	for (cyl = start; cyl <= end; cyl++) {
+		for (head = (side == 2) ? 0 : side; head < ((side == 2) ? 2 : side + 1); head++) {
+			plan[num].trk = (side == 2) ? cyl * 2 + head : cyl;
+			plan[num].cyl = cyl;
+			plan[num].head = head;
+			if (plan[num].trk >= D88_MAXTRACK) {
+				printf("Track %d: out of D88 image\n", plan[num].trk);
+				free(plan);
+				return -1;
+			}
+			plan[num].offset = img->hdr->adwTrackOffsets[plan[num].trk];
+			if (compileTrackPlan(&plan[num], img->trk[plan[num].trk].sects, img->trk[plan[num].trk].sec,
+				img->trk[plan[num].trk].data, trklen) != 0) {
+				free(plan);
+				return -1;
+			}
+			num++;
+		}
+	}
+	*planPtr = plan;
+	return num;
+}
+
+/* Print restore plan */
+void printRestorePlan(struct track_plan *plan, int num)
+{
+	int cnt;
+	int grp;
+	struct write_group *group;
+	
+	printf("Track  C  H Offset     Enc N  Sects Gap3 Fill Write\n");
+	for (cnt = 0; cnt < num; cnt++, plan++) {
+		printf("%5d %2d %2d 0x%.8x %.2X  %.2X %5d %4d",
+			plan->trk, plan->cyl, plan->head, plan->offset, plan->enc, plan->n, plan->count, plan->gap3);
+		if (plan->sects == 0) {
+			printf("   -- unformat\n");
+			continue;
+		}
+		printf("   %.2X", plan->fill);
+		for (grp = 0; grp < plan->groups; grp++) {
+			group = &plan->group[grp];
+			if (group->count == 1) {
+				printf(" %.2X", plan->id[group->first].r);
+			} else {
+				printf(" %.2X-%.2X", plan->id[group->first].r, plan->id[group->first + group->count - 1].r);
+			}
+		}
+		printf("%s\n", (plan->groups == 0) ? " none" : "");
+	}
+}
+
+/* Mean GAP3 between IDs of the timing map in bytes, -1: less than 2 sectors */
+int calcTimingGap(struct timing_map *tm, struct timing_entry *entry, int sects)
+{
+	int pitch;
+	
+	if (sects < 2) {
+		return -1;
+	}
+	/* ID pitch in the bytes of the encoding, FM bytes are twice as long */
+	pitch = (long long)(entry[sects - 1].pos - entry[0].pos) * tm->trklen / tm->rev / (sects - 1);
+	if (entry[0].enc == D88_ENCODE_MFM) {
+		return pitch - (62 + NSECSIZE(entry[0].id.n));
+	}
+	return pitch / 2 - (33 + NSECSIZE(entry[0].id.n));
+}
+
+/* Find entries of the track in timing map, returns the number of them */
+int findTimingTrack(struct timing_map *tm, int trk, struct timing_entry **entry)
+{
+	int cnt = 0;
+	int num = 0;
+	
+	/* Entries of a track are in a row */
+	while ((cnt < tm->num) && (tm->entry[cnt].trk != trk)) {
+		cnt++;
+	}
+	*entry = &tm->entry[cnt];
+	while ((cnt + num < tm->num) && (tm->entry[cnt + num].trk == trk)) {
+		num++;
+	}
+	return num;
+}
+
+/* Arrange restore plan as timing map, sectors in the recorded physical order and GAP3 of the recorded pitch */
+int applyTimingMap(char *timename, struct d88_image *img, struct track_plan *plan, int num, int trklen)
+{
+	int cnt;
+	int idx;
+	int sects;
+	int gap3;
+	int arranged = 0;
+	unsigned char used[MAXSECNUM];
+	struct D88_SECTOR sec[MAXSECNUM];
+	unsigned char *data[MAXSECNUM];
+	struct d88_track *t;
+	struct timing_entry *entry;
+	struct timing_map tm;
+	
+	if (loadTimingMap(timename, &tm) < 0) {
+		return -1;
+	}
+	for (; num > 0; num--, plan++) {
+		t = &img->trk[plan->trk];
+		if ((plan->sects == 0) || ((sects = findTimingTrack(&tm, plan->trk, &entry)) == 0)) {
+			continue;
+		}
+		if (sects != plan->sects) {
+			printf("Track %d: %d sectors in timing map, %d in image\n", plan->trk, sects, plan->sects);
+			continue;
+		}
+		/* Sector of the same ID in the image for each entry, the same IDs in their order */
+		memset(used, 0, sizeof(used));
+		for (cnt = 0; cnt < sects; cnt++) {
+			for (idx = 0; idx < sects; idx++) {
+				if ((used[idx] == 0) && (memcmp(&t->sec[idx].c, &entry[cnt].id, sizeof(entry[cnt].id)) == 0)) {
+					break;
+				}
+			}
+			if (idx == sects) {
+				break;
+			}
+			used[idx] = 1;
+			sec[cnt] = t->sec[idx];
+			data[cnt] = t->data[idx];
+		}
+		if (cnt != sects) {
+			printf("Track %d: sector %.2X of timing map is not in image\n", plan->trk, entry[cnt].id.r);
+			continue;
+		}
+		memcpy(t->sec, sec, sizeof(*sec) * sects);
+		memcpy(t->data, data, sizeof(*data) * sects);
+		if (compileTrackPlan(plan, t->sects, t->sec, t->data, trklen) != 0) {
+			free(tm.entry);
+			return -1;
+		}
+		/* Recorded GAP3 when it fits the track */
+		gap3 = calcTimingGap(&tm, entry, sects);
+		if ((gap3 > 0) && (gap3 < plan->gap3) && (entry[0].enc == plan->enc) && (entry[0].id.n == plan->n)) {
+			plan->gap3 = gap3;
+		}
+		arranged++;
+	}
+	printf("*TimingMap  : %s / Tracks:%d\n", timename, arranged);
+	free(tm.entry);
+	return 0;
+}
+
+/* Print timing map of the tracks in range with interleave, skew and gaps between IDs */
+int printTimingMap(char *timename, int start, int end, int side)
+{
+	int trk;
+	int cnt;
+	int idx;
+	int sects;
+	int cyl;
+	int gap3;
+	int gap;
+	int mingap;
+	int maxgap;
+	int inter;
+	int step[MAXSECNUM + 1];
+	struct timing_entry *entry;
+	struct timing_map tm;
+	
+	if (loadTimingMap(timename, &tm) < 0) {
+		return -1;
+	}
+	printf("Timing map: %s / Revolution:%dusec / Length:%d\n", timename, tm.rev, tm.trklen);
+	printf("Track Enc Sects First Interleave Skew[deg] Gap3 Min  Max\n");
+	for (trk = 0; trk < 164; trk++) {
+		cyl = (side == 2) ? trk / 2 : trk;
+		if ((cyl < start) || (cyl > end) || ((sects = findTimingTrack(&tm, trk, &entry)) == 0)) {
+			continue;
+		}
+		/* Interleave is the most frequent physical step from R to R+1 */
+		memset(step, 0, sizeof(step));
+		for (cnt = 0; cnt < sects; cnt++) {
+			for (idx = 0; idx < sects; idx++) {
+				if (entry[idx].id.r == entry[cnt].id.r + 1) {
+					step[(idx - cnt + sects) % sects]++;
+					break;
+				}
+			}
+		}
+		inter = 0;
+		for (idx = 1; idx < sects; idx++) {
+			inter = (step[idx] > step[inter]) ? idx : inter;
+		}
+		/* GAP3 between neighbouring IDs, the last one is followed by the index gaps */
+		mingap = 0x7fffffff;
+		maxgap = -0x7fffffff;
+		for (cnt = 0; cnt + 1 < sects; cnt++) {
+			gap = calcTimingGap(&tm, &entry[cnt], 2);
+			mingap = (gap < mingap) ? gap : mingap;
+			maxgap = (gap > maxgap) ? gap : maxgap;
+		}
+		gap3 = calcTimingGap(&tm, entry, sects);
+		printf("%5d  %.2X %5d    %.2X ", trk, entry[0].enc, sects, entry[0].id.r);
+		if (inter != 0) {
+			printf("%10d", inter);
+		} else {
+			printf("        --");
+		}
+		printf(" %9.1f", (double)entry[0].pos * 360 / tm.rev);
+		if (gap3 < 0) {
+			printf("   --   --   --\n");
+		} else {
+			printf(" %4d %4d %4d\n", gap3, mingap, maxgap);
+		}
+		if (verbose == 0) {
+			continue;
+		}
+		printf("   C  H  R  N : Position[usec] Angle[deg] Gap3\n");
+		for (cnt = 0; cnt < sects; cnt++) {
+			printf("   %.2X %.2X %.2X %.2X : %14d %10.1f", entry[cnt].id.c, entry[cnt].id.h, entry[cnt].id.r, entry[cnt].id.n,
+				entry[cnt].pos, (double)entry[cnt].pos * 360 / tm.rev);
+			if (cnt + 1 < sects) {
+				printf(" %4d\n", calcTimingGap(&tm, &entry[cnt], 2));
+			} else {
+				printf("   --\n");
+			}
+		}
+	}
+	free(tm.entry);
+	return 0;
+}
+
+/* Queue writes of planned groups, runs are gathered in the transfer buffer and short sectors are padded in pad */
+int writeTrackPlan(int dev, struct track_plan *plan, unsigned char *runBuf, unsigned char *pad, struct fdc_res_cmd *resBuf)
+{
+	int grp;
+	int cnt;
+	struct write_group *group;
+	
+	for (grp = 0; grp < plan->groups; grp++) {
+		group = &plan->group[grp];
+		if (group->count == 1) {
+			if (writeTrackSectors(dev, plan->head, &plan->sec[group->first], &plan->id[group->first], 1,
+				&plan->data[group->first], NULL, pad, &resBuf[group->first]) != 0) {
+				return -1;
+			}
+			/* Next short sector is padded after this one */
+			if (plan->sec[group->first].wLength < NSECSIZE(plan->id[group->first].n)) {
+				pad += NSECSIZE(plan->id[group->first].n);
+			}
+			continue;
+		}
+		for (cnt = group->first; cnt < group->first + group->count; cnt++) {
+			memcpy(runBuf, plan->data[cnt], plan->sec[cnt].wLength);
+			runBuf += plan->sec[cnt].wLength;
+		}
+		if (fdcWriteMultiData(dev, plan->head, GETENCFDC(plan->sec[group->first].bEncoding), &plan->id[group->first],
+			plan->id[group->first + group->count - 1].r, 0, runBuf - plan->sec[group->first].wLength * group->count,
+			&resBuf[group->first]) != 0) {
+			printf("fdcWriteMultiData error\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Check results of multi-sector writes, write sectors of failed runs one by one */
+int checkTrackPlan(int dev, struct track_plan *plan, struct fdc_res_cmd *resBuf)
+{
+	int grp;
+	int cnt;
+	struct write_group *group;
+	
+	for (grp = 0; grp < plan->groups; grp++) {
+		group = &plan->group[grp];
+		if (group->count == 1) {
+			continue;
+		}
+		if (convertStatus(&resBuf[group->first]) != 0) {
+			printf("[WriteData] Side:%d / Run:%.2X-%.2X failed\n", plan->head,
+				plan->id[group->first].r, plan->id[group->first + group->count - 1].r);
+			if (writeTrackSectors(dev, plan->head, &plan->sec[group->first], &plan->id[group->first], group->count,
+				&plan->data[group->first], NULL, NULL, &resBuf[group->first]) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		for (cnt = group->first + 1; cnt < group->first + group->count; cnt++) {
+			resBuf[cnt] = resBuf[group->first];
+		}
+	}
+	return 0;
+}
+
+/* Seek, format and write a track as planned, returns sectors failed to verify */
+int writeFloppyTrack(int dev, struct track_plan *plan, int mult, int verify, int *rewrite)
+{
+	int cnt;
+	int ret;
+	unsigned char runBuf[MAXTRKLEN];
+	unsigned char *pad = NULL;
+	struct fdc_res_cmd res;
+	struct fdc_res_cmd resBuf[MAXSECNUM];
+	struct fdc_res_intr intr;
+	
+	memset(resBuf, 0, sizeof(resBuf));
+	
+	/* Padded short sectors must stay valid until the chain is submitted */
+	if ((plan->padLen != 0) && ((pad = malloc(plan->padLen)) == NULL)) {
+		perror("malloc");
+		return -1;
+	}
+	/* Queue whole track work as one command chain */
+	if ((optimize & OPTIMIZE_BATCH) != 0) {
+		fdcBatchBegin();
+	}
+	/* Seek floppy */
+	printf("[Seek] Cylinder:%d / Step:%d\n", plan->cyl, mult);
+	if (fdcSeek(dev, plan->cyl * mult, &intr) != 0) {
+		printf("fdcSeek error\n");
+		return -1;
+	}
+	/* Format floppy */
+	printf("[Format] Side:%d / Encode:%.2X / SectorSize:%.2X / Sectors:%d / Gap3:%d / Fill:%.2X\n",
+		plan->head, plan->enc, plan->n, plan->count, plan->gap3, plan->fill);
+	if (fdcFormat(dev, plan->head, GETENCFDC(plan->enc), plan->n, plan->count, plan->gap3, plan->fill, plan->id, &res) != 0) {
+		printf("fdcFormat error\n");
+		return -1;
+	}
+	/* Write Data to floppy */
+	if (plan->sects != 0) {
+		printf("[WriteData] Side:%d / Encode:%.2X / Sectors:%d / Commands:%d\n", plan->head, plan->enc, plan->pending, plan->groups);
+	}
+	ret = writeTrackPlan(dev, plan, runBuf, pad, resBuf);
+	if ((ret == 0) && ((optimize & OPTIMIZE_BATCH) != 0) && (fdcBatchSubmit(dev) != 0)) {
+		printf("fdcBatchSubmit error\n");
+		ret = -1;
+	}
+	free(pad);
+	if ((ret != 0) || (checkTrackPlan(dev, plan, resBuf) != 0)) {
+		return -1;
+	}
+	if ((plan->sects != 0) && (verbose != 0)) {
+		printf(" C  H  R  N  DAM : RESULT CODE   : DATA\n");
+		for (cnt = 0; cnt < plan->sects; cnt++) {
+			printf(" %.2X %.2X %.2X %.2X  %.2X : %.2X (%.2X %.2X %.2X) : %.2X\n",
+				plan->id[cnt].c, plan->id[cnt].h, plan->id[cnt].r, plan->id[cnt].n, plan->sec[cnt].bDataAddressMark,
+				convertStatus(&resBuf[cnt]), resBuf[cnt].st0, resBuf[cnt].st1, resBuf[cnt].st2,
+				(plan->sec[cnt].wLength != 0) ? plan->data[cnt][0] : 0x00);
+		}
+	}
+	/* Verify while the head is on the cylinder */
+	if ((verify != 0) && (plan->sects != 0)) {
+		return verifyTrack(dev, plan->head, plan->sec, plan->id, plan->sects, plan->data, rewrite);
+	}
+	return 0;
+}
+
+int restoreFloppyDisk(int mult, int side, int trklen, int diff, int verify, struct d88_image *img,
+	struct track_plan *plan, int tracks)
+{
+	int num;
+	int cnt;
+	int skipped = 0;
+	int rewritten = 0;
+	int reformatted = 0;
+	int verified = 0;
+	int rewrite = 0;
+	int failed = 0;
+	unsigned char differ[MAXSECNUM];
+	long long startTime;
+	
+	struct fdc_res_cmd resBuf[MAXSECNUM];
+	struct fdc_res_intr intr;
+	struct track_buffer tb;
+	struct track_stats ts;
+	
+	printf("Restore Started\n");
+	printf("*Track      : %d - %d\n", plan[0].trk, plan[tracks - 1].trk);
+	printf("*Step       : %d\n", mult);
+	printf("*Side       : %d\n", side);
+	printf("*TrackLength: %d\n", trklen);
+	printf("*Differ     : %d\n", diff);
+	printf("*Verify     : %d\n", verify);
+	printf("*Title      : %.17s\n", img->hdr->szTitle);
+	printf("*WiteProtect: %.2x\n", img->hdr->bWriteProtect);
+	printf("*MediaType  : %.2x\n", img->hdr->bMediaType);
+	startTime = fdcGetTime();
+	memset(&tb, 0, sizeof(tb));
+	
+	/* Execute the plan of each track */
+	for (num = 0; num < tracks; num++, plan++) {
+		printf("\nTrack: %d / Offset: 0x%.8x\n", plan->trk, plan->offset);
+		beginTrackStats(&ts);
+		
+		/* Compare with floppy and write only different sectors */
+		if (diff != 0) {
+			printf("[Seek] Cylinder:%d / Step:%d\n", plan->cyl, mult);
+			if (fdcSeek(FD_DEVNUM, plan->cyl * mult, &intr) != 0) {
+				printf("fdcSeek error\n");
+				return -1;
+			}
+			switch (compareTrack(FD_DEVNUM, plan->head, plan->sec, plan->id, plan->sects, plan->data, &tb, differ)) {
+				case 0:
+					printf("[Compare] Side:%d / Same\n", plan->head);
+					skipped++;
+					endTrackStats(&ts, "restore", FD_DEVNUM, plan->trk, plan->sects, 0);
+					continue;
+				case 1:
+					printf("[Compare] Side:%d / Rewrite:", plan->head);
+					for (cnt = 0; cnt < plan->sects; cnt++) {
+						if (differ[cnt] != 0) {
+							printf(" %.2X", plan->id[cnt].r);
+						}
+					}
+					printf("\n");
+					for (cnt = 0; cnt < plan->sects; cnt++) {
+						differ[cnt] = !differ[cnt];
 					}
-					sects = secPtr->wSectors;
-					memcpy(idPtr++, &(secPtr->c), sizeof(struct fdc_sector_id));
-					/* Read sector data from file */
-					ret = fread(dataPtr, secPtr->wLength, 1, fp);
-					if(ret < 0) {
-						perror("fread");
+					if (writeTrackSectors(FD_DEVNUM, plan->head, plan->sec, plan->id, plan->sects, plan->data, differ, NULL, resBuf) != 0) {
 						return -1;
 					}
-					dataPtr += secPtr->wLength;
-					secPtr++;
-					cnt++;
-				} while ( cnt < sects);
-				/* Calculate GAP3 length */
-				gap3 = calcFormatGapLen(trklen, secBuf[0].n, secBuf[0].wSectors, secBuf[0].bEncoding);
-			}
-			/* Seek floppy */
+					cnt = 0;
+					if (verify != 0) {
+						cnt = verifyTrack(FD_DEVNUM, plan->head, plan->sec, plan->id, plan->sects, plan->data, &rewrite);
+						failed += cnt;
+						verified += plan->sects;
+					}
+					rewritten++;
+					endTrackStats(&ts, "restore", FD_DEVNUM, plan->trk, plan->sects, cnt);
+					continue;
+				default:
+					printf("[Compare] Side:%d / Reformat\n", plan->head);
+					reformatted++;
+					break;
+			}
+		}
+		if ((cnt = writeFloppyTrack(FD_DEVNUM, plan, mult, verify, &rewrite)) < 0) {
+			return -1;
+		}
+		failed += cnt;
+		verified += (verify != 0) ? plan->sects : 0;
+		endTrackStats(&ts, "restore", FD_DEVNUM, plan->trk, plan->sects, cnt);
+	}
+	free(tb.buf);
+	printElapsed(startTime);
+	if (diff != 0) {
+		printf("*Skipped    : %d\n", skipped);
+		printf("*Rewritten  : %d\n", rewritten);
+		printf("*Reformatted: %d\n", reformatted);
+	}
+	if (verify != 0) {
+		printf("*Verified   : %d sectors / Rewritten:%d / Failed:%d\n", verified, rewrite, failed);
+	}
+	printf("Restore Ended\n");
+	return 0;
+}
+
+/* Writer thread, formats and writes queued tracks to the destination drive */
+void *copyWriter(void *arg)
+{
+	int ret;
+	struct copy_pipe *cp = arg;
+	struct dump_pipe *dp = &cp->dp;
+	struct track_buffer *tb;
+	struct track_plan *plan = &cp->plan;
+	struct track_stats ts;
+	
+	pthread_mutex_lock(&dp->lock);
+	for (;;) {
+		while ((dp->flushed == dp->filled) && (dp->closed == 0)) {
+			pthread_cond_wait(&dp->cond, &dp->lock);
+		}
+		if (dp->flushed == dp->filled) {
+			break;
+		}
+		pthread_mutex_unlock(&dp->lock);
+		tb = &dp->pool[dp->flushed % TRKPOOLNUM];
+		
+		/* Track is not available before the source drive read it */
+		fdcSyncTime(tb->time);
+		beginTrackStats(&ts);
+		plan->trk = tb->trk;
+		plan->cyl = (cp->side == 2) ? tb->trk / 2 : tb->trk;
+		plan->head = (cp->side == 2) ? tb->trk % 2 : cp->side;
+		plan->offset = tb->offset;
+		printf("\nTrack: %d / Unit:%d\n", plan->trk, cp->dev);
+		ret = -1;
+		if (compileTrackPlan(plan, tb->sects, tb->sec, tb->data, cp->trklen) == 0) {
+			ret = writeFloppyTrack(cp->dev, plan, cp->mult, cp->verify, &cp->rewrite);
+		}
+		if (ret >= 0) {
+			cp->tracks++;
+			cp->failed += ret;
+			cp->verified += (cp->verify != 0) ? plan->sects : 0;
+			endTrackStats(&ts, "write", cp->dev, plan->trk, plan->sects, ret);
+		}
+		tb->time = fdcGetTime();
+		pthread_mutex_lock(&dp->lock);
+		if (ret < 0) {
+			dp->error = 1;
+		}
+		dp->flushed++;
+		pthread_cond_broadcast(&dp->cond);
+	}
+	cp->endTime = fdcGetTime();
+	pthread_mutex_unlock(&dp->lock);
+	return NULL;
+}
+
+/* Copy floppy disk track by track, reading overlaps with writing on the other drive */
+int copyFloppyDisk(int src, int dst, int start, int end, int mult, int side, int trklen, int verify)
+{
+	int trk;
+	int cyl;
+	int head;
+	int sects;
+	int cnt;
+	int ret = -1;
+	int tracks = 0;
+	int errors = 0;
+	int failed;
+	long long startTime;
+	long long trackTime;
+	
+	pthread_t writer;
+	struct copy_pipe *cp;
+	struct track_buffer *tb;
+	struct track_reader rd;
+	struct track_stats ts;
+	
+	printf("Copy Started\n");
+	printf("*Cylinder   : %d - %d\n", start, end);
+	printf("*Step       : %d\n", mult);
+	printf("*Side       : %d\n", side);
+	printf("*Unit       : %d -> %d\n", src, dst);
+	startTime = fdcGetTime();
+	
+	if ((cp = calloc(1, sizeof(*cp))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	cp->dev = dst;
+	cp->mult = mult;
+	cp->side = side;
+	cp->trklen = trklen;
+	cp->verify = verify;
+	for (cnt = 0; cnt < TRKPOOLNUM; cnt++) {
+		if ((cp->dp.pool[cnt].buf = malloc(TRKBUFLEN)) == NULL) {
+			perror("malloc");
+			goto release;
+		}
+		cp->dp.pool[cnt].bufSize = TRKBUFLEN;
+	}
+	initTrackReader(&rd, src, mult, side, trklen);
+	
+	/* Start destination writer thread */
+	pthread_mutex_init(&cp->dp.lock, NULL);
+	pthread_cond_init(&cp->dp.cond, NULL);
+	if (pthread_create(&writer, NULL, copyWriter, cp) != 0) {
+		perror("pthread_create");
+		goto release;
+	}
+	
+	/* Read tracks from source drive */
+	for (cyl = start; cyl <= end; cyl++) {
+		for (head = (side == 2) ? 0 : side; head < ((side == 2) ? 2 : side + 1); head++) {
+			trk = (side == 2) ? cyl * 2 + head : cyl;
+			if ((tb = getTrackBuffer(&cp->dp)) == NULL) {
+				goto finish;
+			}
+			printf("\nTrack: %d / Unit:%d\n", trk, src);
 			printf("[Seek] Cylinder:%d / Step:%d\n", cyl, mult);
-			if (fdcSeek(FD_DEVNUM, cyl * mult, &intr) != 0) {
+			tb->trk = trk;
+			tb->offset = 0;
+			trackTime = fdcGetTime();
+			beginTrackStats(&ts);
+			if ((sects = readFloppyTrack(&rd, cyl, head, tb)) < 0) {
+				goto finish;
+			}
+			printf("[ReadData] Side:%d / Encode:%.2X / Sectors:%d\n", head, tb->enc, sects);
+			for (cnt = 0, failed = 0; cnt < sects; cnt++) {
+				failed += !ISSTATOK(tb->sec[cnt].bStatus);
+			}
+			errors += failed;
+			tb->end = 0;
+			putTrackBuffer(&cp->dp);
+			endTrackStats(&ts, "read", src, trk, sects, failed);
+			printf("[Result] Revolutions:%.2f\n", (double)(fdcGetTime() - trackTime) / fdcGetRevTime());
+			tracks++;
+		}
+	}
+	ret = 0;
+	
+finish:
+	/* Wait for the writer, copy ends when the destination drive finished */
+	if (closeDumpPipe(&cp->dp, writer) != 0) {
+		ret = -1;
+	}
+	fdcSyncTime(cp->endTime);
+	printElapsed(startTime);
+	printf("*Tracks     : %d read / %d written\n", tracks, cp->tracks);
+	printf("*ReadErrors : %d sectors\n", errors);
+	if (verify != 0) {
+		printf("*Verified   : %d sectors / Rewritten:%d / Failed:%d\n", cp->verified, cp->rewrite, cp->failed);
+	}
+	printf((ret == 0) ? "Copy Ended\n" : "Copy Failed\n");
+	free(cp);
+	return ret;
+	
+release:
+	for (cnt = 0; cnt < TRKPOOLNUM; cnt++) {
+		free(cp->dp.pool[cnt].buf);
+	}
+	free(cp);
+	return -1;
+}
+
+#define PROBECACHE_TITLE	"# Fingerprint Media Drate Rpm Kbps Step Side End\n"
+#define PROBECACHE_FORMAT	"%.16llx %.2x %d %d %d %d %d %d\n"
+
+/* Fingerprint of the boot sector (FNV-1a) */
+unsigned long long fingerprintBoot(int enc, struct fdc_sector_id *id, unsigned char *data, int len)
+{
+	int cnt;
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	unsigned char head[3] = { enc, id->n, len != 0 };
+	
+	for (cnt = 0; cnt < 3; cnt++) {
+		hash = (hash ^ head[cnt]) * 0x100000001b3ULL;
+	}
+	for (cnt = 0; cnt < len; cnt++) {
+		hash = (hash ^ data[cnt]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Load probe cache, returns the number of entries */
+int loadProbeCache(char *cachename, unsigned long long *key, struct media_info *info, int max)
+{
+	int num = 0;
+	char line[256];
+	struct media_info *mi;
+	FILE *fp;
+	
+	if ((fp = fopen(cachename, "r")) == NULL) {
+		return 0;
+	}
+	while ((num < max) && (fgets(line, sizeof(line), fp) != NULL)) {
+		mi = &info[num];
+		if ((line[0] != '#') && (sscanf(line, "%llx %x %d %d %d %d %d %d", &key[num], &mi->media, &mi->drate, &mi->rpm,
+			&mi->kbps, &mi->mult, &mi->side, &mi->end) == 8)) {
+			num++;
+		}
+	}
+	fclose(fp);
+	return num;
+}
+
+/* Add a probed disk to the cache */
+int saveProbeCache(char *cachename, unsigned long long key, struct media_info *mi)
+{
+	int title;
+	FILE *fp;
+	
+	title = (access(cachename, F_OK) != 0);
+	if ((fp = fopen(cachename, "a")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	if (title != 0) {
+		fprintf(fp, PROBECACHE_TITLE);
+	}
+	fprintf(fp, PROBECACHE_FORMAT, key, mi->media, mi->drate, mi->rpm, mi->kbps, mi->mult, mi->side, mi->end);
+	fclose(fp);
+	return 0;
+}
+
+/* Revolution time from the same ID read again, rounded to 300 or 360 rpm */
+int measureRpm(int dev, int enc)
+{
+	int cnt;
+	long long time;
+	struct fdc_res_cmd first;
+	struct fdc_res_cmd res;
+	
+	if ((fdcReadId(dev, 0, GETENCFDC(enc), &first) != 0) || (convertStatus(&first) != 0)) {
+		return -1;
+	}
+	time = fdcGetTime();
+	for (cnt = 0; cnt < MAXSECNUM; cnt++) {
+		if ((fdcReadId(dev, 0, GETENCFDC(enc), &res) != 0) || (convertStatus(&res) != 0)) {
+			return -1;
+		}
+		if ((res.c == first.c) && (res.h == first.h) && (res.r == first.r) && (res.n == first.n)) {
+			return ((fdcGetTime() - time) < 60000000 / 330) ? 360 : 300;
+		}
+	}
+	return -1;
+}
+
+/* Detect data rate, encoding, sides, seek step, cylinders and rpm of the disk, the result is cached by
+   the boot sector fingerprint so that another disk of the same title is only probed for its data rate */
+int detectMedia(int dev, char *cachename, struct media_info *mi)
+{
+	int cnt;
+	int num = 0;
+	int enc = -1;
+	int rate;
+	int order[3 + PROBECACHE];
+	int orders = 0;
+	int len = 0;
+	int cyl;
+	int nominal;
+	long long startTime;
+	unsigned long long key;
+	unsigned long long *keys;
+	unsigned char data[NSECSIZE(8)];
+	struct media_info *cache;
+	struct fdc_res_cmd res;
+	struct fdc_res_intr intr;
+	struct fdc_sector_id id;
+	
+	startTime = fdcGetTime();
+	if (((keys = malloc(sizeof(*keys) * PROBECACHE)) == NULL) || ((cache = malloc(sizeof(*cache) * PROBECACHE)) == NULL)) {
+		perror("malloc");
+		free(keys);
+		return -1;
+	}
+	if (cachename != NULL) {
+		num = loadProbeCache(cachename, keys, cache, PROBECACHE);
+	}
+	/* Data rates of recent disks first, a wrong one costs timeouts of READ ID */
+	for (cnt = num - 1; cnt >= -3; cnt--) {
+		rate = (cnt >= 0) ? cache[cnt].drate : -1 - cnt;
+		for (len = 0; (len < orders) && (order[len] != rate); len++) {
+		}
+		if (len == orders) {
+			order[orders++] = rate;
+		}
+	}
+	if (fdcSeek(dev, 0, &intr) != 0) {
+		printf("fdcSeek error\n");
+		goto error;
+	}
+	for (cnt = 0; cnt < orders; cnt++) {
+		fdcSetDataRate(order[cnt]);
+		if ((enc = probeTrackEncoding(dev, 0, D88_ENCODE_MFM)) >= 0) {
+			break;
+		}
+	}
+	if (enc < 0) {
+		printf("[Detect] No ID on cylinder 0 at any data rate\n");
+		goto error;
+	}
+	mi->drate = order[cnt];
+	mi->kbps = (mi->drate == 0) ? 500 : (mi->drate == 1) ? 300 : 250;
+	
+	/* Fingerprint of the boot sector (R=1 with the size of the ID found) */
+	len = 0;
+	memset(&id, 0, sizeof(id));
+	if ((fdcReadId(dev, 0, GETENCFDC(enc), &res) == 0) && (convertStatus(&res) == 0)) {
+		id.c = res.c;
+		id.h = res.h;
+		id.r = 1;
+		id.n = res.n;
+		if ((fdcReadData(dev, 0, GETENCFDC(enc), &id, 0, data, &res) == 0) && (convertStatus(&res) == 0)) {
+			len = NSECSIZE(id.n);
+		}
+	}
+	key = fingerprintBoot(enc, &id, data, len);
+	for (cnt = num - 1; cnt >= 0; cnt--) {
+		if ((keys[cnt] == key) && (cache[cnt].drate == mi->drate)) {
+			*mi = cache[cnt];
+			printf("[Detect] Fingerprint:%.16llx / Cached\n", key);
+			goto found;
+		}
+	}
+	printf("[Detect] Fingerprint:%.16llx / Probing\n", key);
+	
+	/* Revolution, sides and step (48tpi media in 96tpi drive reads C=1 on physical cylinder 2) */
+	if ((mi->rpm = measureRpm(dev, enc)) < 0) {
+		mi->rpm = (mi->kbps == 250) ? 300 : 360;
+	}
+	mi->side = (probeTrackEncoding(dev, 1, enc) >= 0) ? 2 : 0;
+	mi->mult = 1;
+	if (mi->kbps != 500) {
+		if (fdcSeek(dev, 4, &intr) != 0) {
+			printf("fdcSeek error\n");
+			goto error;
+		}
+		if (((enc = probeTrackEncoding(dev, 0, D88_ENCODE_MFM)) >= 0) && (fdcReadId(dev, 0, GETENCFDC(enc), &res) == 0) &&
+			(convertStatus(&res) == 0) && (res.c == 2)) {
+			mi->mult = 2;
+		}
+		if ((mi->side == 0) && (enc >= 0) && (probeTrackEncoding(dev, 1, enc) >= 0)) {
+			mi->side = 2;
+		}
+	}
+	if (mi->kbps == 500) {
+		mi->media = D88_TYPE_2HD;
+		nominal = (mi->rpm == 360) ? 76 : 79;
+	} else if (mi->mult == 2) {
+		mi->media = (mi->side == 2) ? D88_TYPE_2D : D88_TYPE_1D;
+		nominal = 39;
+	} else {
+		mi->media = (mi->side == 2) ? D88_TYPE_2DD : D88_TYPE_1DD;
+		nominal = 79;
+	}
+	/* Cylinders formatted beyond the nominal ones */
+	mi->end = nominal;
+	for (cyl = nominal + 1; cyl <= nominal + 2; cyl++) {
+		if ((fdcSeek(dev, cyl * mi->mult, &intr) != 0) || (probeTrackEncoding(dev, 0, D88_ENCODE_MFM) < 0)) {
+			break;
+		}
+		mi->end = cyl;
+	}
+	if (cachename != NULL) {
+		saveProbeCache(cachename, key, mi);
+	}
+	
+found:
+	fdcSetDataRate(mi->drate);
+	printf("*Detected   : Media:%.2x / Drate:%d / %drpm / %dkbps / Step:%d / Side:%d / Cylinder:0-%d (%.1f revolutions)\n",
+		mi->media, mi->drate, mi->rpm, mi->kbps, mi->mult, mi->side, mi->end,
+		(double)(fdcGetTime() - startTime) / fdcGetRevTime());
+	free(keys);
+	free(cache);
+	return 0;
+	
+error:
+	free(keys);
+	free(cache);
+	return -1;
+}
+
+#define SEEKPROFILE_TITLE	"# Drive Step[usec] Load[msec] Unload[msec]\n"
+#define SEEKPROFILE_FORMAT	"%s %d %d %d\n"
+#define SEEKPROFILE_LINES	64
+
+/* Name of a drive in the seek profile */
+void getDriveName(char *buf, int size, int unit, int emu)
+{
+	snprintf(buf, size, (emu != 0) ? "emulator%d" : "/dev/fd%d", unit);
+}
+
+/* Load seek profile of the drive, returns 1 when the drive is not in the file */
+int loadSeekProfile(char *profname, char *drive, struct seek_profile *prof)
+{
+	int ret = 1;
+	char line[512];
+	char name[256];
+	FILE *fp;
+	
+	if ((fp = fopen(profname, "r")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((line[0] != '#') && (sscanf(line, "%255s %d %d %d", name, &prof->step, &prof->load, &prof->unload) == 4) &&
+			(strcmp(name, drive) == 0)) {
+			ret = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+/* Save seek profile of the drive, profiles of other drives are kept */
+int saveSeekProfile(char *profname, char *drive, struct seek_profile *prof)
+{
+	int num = 0;
+	int cnt;
+	char (*lines)[512];
+	char name[256];
+	char tmpname[PATH_MAX];
+	FILE *fp;
+	
+	if ((lines = malloc(sizeof(*lines) * SEEKPROFILE_LINES)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((fp = fopen(profname, "r")) != NULL) {
+		while ((num < SEEKPROFILE_LINES) && (fgets(lines[num], sizeof(lines[num]), fp) != NULL)) {
+			if ((lines[num][0] == '#') || (sscanf(lines[num], "%255s", name) != 1) || (strcmp(name, drive) == 0)) {
+				continue;
+			}
+			num++;
+		}
+		fclose(fp);
+	}
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", profname);
+	if ((fp = fopen(tmpname, "w")) == NULL) {
+		perror("fopen");
+		free(lines);
+		return -1;
+	}
+	fprintf(fp, SEEKPROFILE_TITLE);
+	for (cnt = 0; cnt < num; cnt++) {
+		fputs(lines[cnt], fp);
+	}
+	fprintf(fp, SEEKPROFILE_FORMAT, drive, prof->step, prof->load, prof->unload);
+	free(lines);
+	if ((fclose(fp) != 0) || (rename(tmpname, profname) != 0)) {
+		perror("rename");
+		return -1;
+	}
+	return 0;
+}
+
+/* Apply seek profile of the drive if it is calibrated */
+int applySeekProfile(int dev, char *profname, char *drive)
+{
+	struct seek_profile prof;
+	
+	switch (loadSeekProfile(profname, drive, &prof)) {
+		case 0:
+			printf("*SeekProfile: %s / Step:%dus / Load:%dms / Unload:%dms\n", drive, prof.step, prof.load, prof.unload);
+			return fdcSpecify(dev, prof.step, prof.load, prof.unload);
+		case 1:
+			printf("*SeekProfile: %s is not calibrated\n", drive);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/* Seek along the pattern reading an ID after each seek, returns 1 when the head is not where expected
+   and 2 when the ID is not read right after the seek */
+int runSeekPattern(int dev, int mult, struct seek_point *point, int num, long long *seekTime, long long *idTime)
+{
+	int cnt;
+	long long time;
+	struct fdc_res_intr intr;
+	struct fdc_res_cmd res;
+	
+	*seekTime = 0;
+	*idTime = 0;
+	for (cnt = 0; cnt < num; cnt++) {
+		time = fdcGetTime();
+		if (fdcSeek(dev, point[cnt].cyl * mult, &intr) != 0) {
+			return -1;
+		}
+		*seekTime += fdcGetTime() - time;
+		if (point[cnt].enc < 0) {
+			continue;
+		}
+		if (fdcReadId(dev, 0, GETENCFDC(point[cnt].enc), &res) != 0) {
+			return -1;
+		}
+		*idTime += fdcGetTime() - time;
+		if (convertStatus(&res) != 0) {
+			return 2;
+		}
+		if (res.c != point[cnt].c) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Recalibrate until the head reaches track 0 */
+int recalibrateDrive(int dev)
+{
+	int retry;
+	struct fdc_res_intr intr;
+	
+	for (retry = 0; retry < 4; retry++) {
+		if (fdcRecalibrate(dev, &intr) != 0) {
+			return -1;
+		}
+		if ((intr.st0 & FDC_ST0_EC) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Try the profile with the pattern, prints measured seek time */
+int trySeekProfile(int dev, int mult, struct seek_point *point, int num, struct seek_profile *prof)
+{
+	int pass;
+	int ret = 0;
+	int ids = 0;
+	long long seekTime;
+	long long idTime;
+	long long seekSum = 0;
+	long long idSum = 0;
+	
+	for (pass = 0; pass < num; pass++) {
+		ids += (point[pass].enc >= 0) ? 1 : 0;
+	}
+	if ((prof != NULL) && (fdcSpecify(dev, prof->step, prof->load, prof->unload) != 0)) {
+		return -1;
+	}
+	if (recalibrateDrive(dev) != 0) {
+		printf("fdcRecalibrate error\n");
+		return -1;
+	}
+	for (pass = 0; (pass < CALIBPASS) && (ret == 0); pass++) {
+		ret = runSeekPattern(dev, mult, point, num, &seekTime, &idTime);
+		seekSum += seekTime;
+		idSum += idTime;
+	}
+	if (prof != NULL) {
+		printf("[Profile] Step:%5dus / Load:%3dms", prof->step, prof->load);
+	} else {
+		printf("[Profile] Current drive setting  ");
+	}
+	if (ret != 0) {
+		printf(" : %s\n", (ret == 1) ? "NG (head is off the cylinder)" : (ret == 2) ? "NG (ID error after seek)" : "NG (command error)");
+		return ret;
+	}
+	printf(" : Seek:%6lldus / Seek+ReadID:%6lldus (average)\n", seekSum / (CALIBPASS * num), idSum / (CALIBPASS * ids));
+	return 0;
+}
+
+/* Find the fastest step rate reading the right cylinder, save it as the profile of the drive */
+int calibrateFloppyDrive(int dev, char *drive, int start, int end, int mult, int kbps, char *profname)
+{
+	int cnt;
+	int code;
+	int num = 0;
+	int ids = 0;
+	int pattern[10];
+	long long startTime;
+	struct seek_point point[10];
+	struct seek_profile prof;
+	struct seek_profile best;
+	struct seek_profile safe;
+	struct fdc_res_cmd res;
+	struct fdc_res_intr intr;
+	
+	printf("Calibrate Started\n");
+	printf("*Cylinder   : %d - %d\n", start, end);
+	printf("*Step       : %d\n", mult);
+	printf("*Drive      : %s\n", drive);
+	printf("*Profile    : %s\n", profname);
+	startTime = fdcGetTime();
+	
+	/* Full strokes, short hops and single steps in both directions */
+	pattern[0] = end;
+	pattern[1] = start;
+	pattern[2] = (start + end) / 2;
+	pattern[3] = start + 1;
+	pattern[4] = end;
+	pattern[5] = end - 1;
+	pattern[6] = start;
+	pattern[7] = start + 2;
+	pattern[8] = (start + end) / 2 + 1;
+	pattern[9] = start;
+	for (cnt = 0; cnt < 10; cnt++) {
+		if ((pattern[cnt] < start) || (pattern[cnt] > end) || ((num != 0) && (pattern[cnt] == point[num - 1].cyl))) {
+			continue;
+		}
+		point[num++].cyl = pattern[cnt];
+	}
+	
+	/* IDs of the pattern read with the current setting */
+	for (cnt = 0; cnt < num; cnt++) {
+		if (fdcSeek(dev, point[cnt].cyl * mult, &intr) != 0) {
+			printf("fdcSeek error\n");
+			return -1;
+		}
+		point[cnt].enc = checkTrackEncoding(dev, 0);
+		if ((point[cnt].enc >= 0) && (fdcReadId(dev, 0, GETENCFDC(point[cnt].enc), &res) == 0) && (convertStatus(&res) == 0)) {
+			point[cnt].c = res.c;
+			ids++;
+		} else {
+			point[cnt].enc = -1;
+		}
+	}
+	if (ids == 0) {
+		printf("No formatted cylinder to validate seeks\n");
+		return -1;
+	}
+	if (trySeekProfile(dev, mult, point, num, NULL) != 0) {
+		return -1;
+	}
+	
+	/* Step rate faster and faster (SRT 8 to 15) while the head lands on the cylinder,
+	   one setting slower than the fastest passed is taken as margin */
+	best.step = -1;
+	prof.load = CALIBLOAD;
+	prof.unload = CALIBUNLOAD;
+	for (code = 8; code <= 15; code++) {
+		prof.step = (16 - code) * 1000 * 500 / kbps;
+		if (trySeekProfile(dev, mult, point, num, &prof) != 0) {
+			break;
+		}
+		safe = (best.step < 0) ? prof : best;
+		best = prof;
+	}
+	if (best.step < 0) {
+		printf("No step rate passed\n");
+		return -1;
+	}
+	/* Head load time is kept, reads follow the seeks within the unload time and HLT is not exercised */
+	best = safe;
+	
+	/* Leave the drive with the profile */
+	if ((fdcSpecify(dev, best.step, best.load, best.unload) != 0) || (recalibrateDrive(dev) != 0)) {
+		printf("fdcRecalibrate error\n");
+		return -1;
+	}
+	if (saveSeekProfile(profname, drive, &best) != 0) {
+		return -1;
+	}
+	printElapsed(startTime);
+	printf("*Profile    : Step:%dus / Load:%dms / Unload:%dms\n", best.step, best.load, best.unload);
+	printf("Calibrate Ended\n");
+	return 0;
+}
+
+static volatile sig_atomic_t BatchStop = 0;
+
+static void stopBatch(int sig)
+{
+	BatchStop = 1;
+}
+
+/* Expand filename template, %n: sequence number (%03n: zero padded), %d: date, %t: time */
+int expandTemplate(char *buf, int size, const char *pattern, int seq)
+{
+	int len = 0;
+	int width;
+	int zero;
+	int hasSeq = 0;
+	time_t now = time(NULL);
+	struct tm tm;
+	
+	localtime_r(&now, &tm);
+	while ((*pattern != '\0') && (len < size - 1)) {
+		if (*pattern != '%') {
+			buf[len++] = *pattern++;
+			continue;
+		}
+		pattern++;
+		width = 0;
+		zero = (*pattern == '0');
+		while ((*pattern >= '0') && (*pattern <= '9')) {
+			width = width * 10 + (*pattern++ - '0');
+		}
+		switch (*pattern) {
+			case 'n':
+				len += snprintf(buf + len, size - len, (zero != 0) ? "%0*d" : "%*d", width, seq);
+				hasSeq = 1;
+				break;
+			case 'd':
+				len += strftime(buf + len, size - len, "%Y%m%d", &tm);
+				break;
+			case 't':
+				len += strftime(buf + len, size - len, "%H%M%S", &tm);
+				break;
+			case '%':
+				buf[len++] = '%';
+				break;
+			default:
+				fprintf(stderr, "error: invalid template %%%c\n", *pattern);
+				return -1;
+		}
+		if (*pattern != '\0') {
+			pattern++;
+		}
+	}
+	buf[(len < size) ? len : size - 1] = '\0';
+	return hasSeq;
+}
+
+/* Wait until a disk not dumped yet is in the drive, returns 1 when the session is over */
+int waitNewDisk(int dev, int *removed)
+{
+	int changed;
+	struct fdc_res_intr intr;
+	
+	for (;;) {
+		if (BatchStop != 0) {
+			return 1;
+		}
+		if ((changed = fdcDiskChanged(dev)) < 0) {
+			return (errno == ENOMEDIUM) ? 1 : -1;
+		}
+		if (changed != 0) {
+			/* Step pulse resets the change line only with a disk inserted */
+			if ((fdcSeek(dev, 1, &intr) != 0) || (fdcSeek(dev, 0, &intr) != 0)) {
 				printf("fdcSeek error\n");
 				return -1;
 			}
-			/* Format floppy */
-			secPtr = secBuf;
-			printf("[Format] Side:%d / Encode:%.2X / SectorSize:%.2X / Sectors:%d / Gap3:%d\n",
-				head, secPtr->bEncoding, secPtr->n, secPtr->wSectors, gap3);
-			if (fdcFormat(FD_DEVNUM, head, GETENCFDC(secPtr->bEncoding), secPtr->n, secPtr->wSectors, gap3, 0x00, idBuf, &res) != 0) {
-				printf("fdcFormat error\n");
-				return -1;
+			if ((changed = fdcDiskChanged(dev)) < 0) {
+				return (errno == ENOMEDIUM) ? 1 : -1;
 			}
-			if (offset != 0) {
-				secPtr = secBuf;
-				idPtr = idBuf;
-				dataPtr = data;
-				cnt = 0;
-				/* Write Data to floppy */
-				printf("[WriteData] Side:%d / Encode:%.2X / Sectors:%d\n", head, secPtr->bEncoding, secPtr->wSectors);
-				if (verbose != 0) {
-					printf(" C  H  R  N  DAM : RESULT CODE   : DATA\n");
+			if (changed != 0) {
+				if (*removed == 0) {
+					printf("\n[Batch] Insert next disk (Ctrl-C to end)\n");
 				}
-				do {
-					if (verbose != 0) {
-						printf(" %.2X %.2X %.2X %.2X  %.2X : ", idPtr->c, idPtr->h, idPtr->r, idPtr->n, secPtr->bDataAddressMark);
-					}
-					if (fdcWriteData(FD_DEVNUM, head, GETENCFDC(secPtr->bEncoding), idPtr++, ISDAMDEL(secPtr->bDataAddressMark), dataPtr, &res) != 0) {
-						printf("fdcWriteData error\n");
-						return -1;
-					}
-					if (verbose != 0) {
-						printf("%.2X (%.2X %.2X %.2X) : %.2X\n", convertStatus(&res), res.st0, res.st1, res.st2, *dataPtr);
-					}
-					dataPtr += secPtr->wLength;
-					secPtr++;
-					cnt++;
-				} while (cnt < sects);
+				*removed = 1;
+			} else {
+				*removed = 0;
+				return 0;
 			}
-			head++;
-			trk++;
-		} while (head != side);
+		} else if (*removed != 0) {
+			*removed = 0;
+			return 0;
+		}
+		fdcDelay(BATCHPOLL);
 	}
-	fclose(fp);
-	printf("Restore Ended\n");
-	return 0;
+}
+
+/* Dump every disk inserted into the drive, the drive stays open and calibrated during the session */
+int batchFloppyDisk(int start, struct media_info *opt, int protect, int cutoff, int passes, int timing, int detect,
+	char *cachename, char *pattern)
+{
+	int seq = 0;
+	int hasSeq;
+	int ret = 0;
+	int removed = 1;
+	int failed = 0;
+	int remain;
+	int diskProtect;
+	long long startTime;
+	long long diskTime;
+	long long elapsed;
+	char filename[PATH_MAX];
+	char mapname[PATH_MAX + 8];
+	char timename[PATH_MAX + 8];
+	struct media_info mi;
+	struct dump_stats disk;
+	struct dump_stats total;
+	struct fdc_res_sens sens;
+	struct sigaction sa;
+	
+	printf("Batch Started\n");
+	printf("*Template   : %s\n", pattern);
+	startTime = fdcGetTime();
+	memset(&total, 0, sizeof(total));
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stopBatch;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sa, NULL);
+	
+	while ((ret = waitNewDisk(FD_DEVNUM, &removed)) == 0) {
+		/* Next name not used yet */
+		do {
+			if ((hasSeq = expandTemplate(filename, sizeof(filename), pattern, ++seq)) < 0) {
+				ret = -1;
+				break;
+			}
+		} while ((hasSeq != 0) && (access(filename, F_OK) == 0));
+		if (ret != 0) {
+			break;
+		}
+		if (access(filename, F_OK) == 0) {
+			fprintf(stderr, "error: %s exists, add %%n to the template\n", filename);
+			ret = -1;
+			break;
+		}
+		printf("\n[Batch] Disk:%d / Filename:%s\n", total.disks + 1, filename);
+		
+		/* Media of each disk */
+		mi = *opt;
+		if ((detect != 0) && (detectMedia(FD_DEVNUM, cachename, &mi) != 0)) {
+			printf("[Batch] Disk:%d / Media not detected\n", total.disks + 1);
+			failed++;
+			continue;
+		}
+		if ((detect & DETECT_RANGE) == 0) {
+			mi.end = opt->end;
+		}
+		fdcSetRpm(mi.rpm);
+		
+		/* Write protect tab of each disk */
+		diskProtect = protect;
+		if (diskProtect < 0) {
+			fdcSenseDrive(FD_DEVNUM, &sens);
+			diskProtect = ((sens.st3 & FDC_ST3_WP) != 0) ? D88_PROTECT_ON : D88_PROTECT_OFF;
+		}
+		snprintf(mapname, sizeof(mapname), "%s.map", filename);
+		snprintf(timename, sizeof(timename), "%s.tim", filename);
+		if (dumpFloppyDisk(start, mi.end, mi.mult, mi.side, mi.media, diskProtect, cutoff, 0, calcTrackLength(mi.rpm, mi.kbps),
+			filename, (passes > 0) ? mapname : NULL, (timing != 0) ? timename : NULL, &disk) != 0) {
+			printf("[Batch] Disk:%d / Dump failed\n", total.disks + 1);
+			failed++;
+			continue;
+		}
+		if ((passes > 0) && (disk.errors != 0)) {
+			diskTime = fdcGetTime();
+			if ((remain = rescueFloppyDisk(mi.end, mi.mult, passes, filename, mapname)) >= 0) {
+				disk.errors = remain;
+			}
+			disk.time += fdcGetTime() - diskTime;
+		}
+		printf("\n[Batch] Disk:%d / Tracks:%d / Blank:%d / Sectors:%d / Errors:%d / Time:%lld.%.3lld sec\n",
+			total.disks + 1, disk.tracks, disk.blank, disk.sectors, disk.errors,
+			disk.time / 1000000, (disk.time / 1000) % 1000);
+		total.disks++;
+		total.tracks += disk.tracks;
+		total.blank += disk.blank;
+		total.sectors += disk.sectors;
+		total.errors += disk.errors;
+		total.time += disk.time;
+		failed += (disk.errors != 0) ? 1 : 0;
+	}
+	signal(SIGINT, SIG_DFL);
+	
+	/* Session statistics */
+	printElapsed(startTime);
+	elapsed = fdcGetTime() - startTime;
+	printf("*Disks      : %d / With errors:%d\n", total.disks, failed);
+	printf("*Tracks     : %d / Blank:%d\n", total.tracks, total.blank);
+	printf("*Sectors    : %d / Errors:%d\n", total.sectors, total.errors);
+	if (total.disks != 0) {
+		printf("*PerDisk    : %lld.%.3lld sec dump / %lld.%.3lld sec with disk change\n",
+			total.time / total.disks / 1000000, (total.time / total.disks / 1000) % 1000,
+			elapsed / total.disks / 1000000, (elapsed / total.disks / 1000) % 1000);
+	}
+	printf("Batch Ended\n");
+	return (ret < 0) ? -1 : 0;
 }
 
 int main(int argc, char* argv[])
 {
 	struct fdc_res_intr intr;
 	struct fdc_res_sens sens;
+	struct d88_image img;
+	struct track_plan *plan = NULL;
+	int tracks = 0;
 	
 	int media   = D88_TYPE_2HD;
-	int protect = D88_PROTECT_OFF;
+	int protect = -1;
 	int start = 0;
 	int end	  = 81;
 	int mult  = 1;
@@ -499,22 +3765,35 @@ int main(int argc, char* argv[])
 	int rpm   = 360;
 	int kbps  = 500;
 	int drate = 0;
+	int cutoff = 0;
+	int passes = 0;
+	int resume = 0;
+	int diff = 0;
+	int verify = 0;
+	int showPlan = 0;
+	int timing = 0;
+	int dst = -1;
 	int trklen;
 	char *filename;
+	char mapname[PATH_MAX];
+	char timename[PATH_MAX + 8];
+	char *emuimage = NULL;
+	char *profname = NULL;
+	char *cachename = NULL;
+	char *reportname = NULL;
+	char *logname = NULL;
+	char *tracename = NULL;
+	char *replayname = NULL;
+	char drive[64];
+	int detect = 0;
+	struct media_info mi;
 	
 	int opt;
 	char *subopts;
 	char *value;
 	
-	fdcInit();
-	
-	/* Check write protect */
-	fdcSenseDrive(FD_DEVNUM, &sens);
-	if ((sens.st3 & FDC_ST3_WP) != 0) {
-		protect = D88_PROTECT_ON;
-	}
 	/* Get option parameter */
-	while((opt = getopt(argc, argv,"hvm:w:C:S:M:D:R:")) != -1){
+	while((opt = getopt(argc, argv,"hvrdVpGm:w:C:S:M:D:R:O:E:B:P:K:A:J:L:T:Y:")) != -1){
 		switch(opt){
 			case 'h':
 				usage();
@@ -523,6 +3802,21 @@ int main(int argc, char* argv[])
 			case 'v':
 				verbose = 1;
 				break;
+			case 'r':
+				resume = 1;
+				break;
+			case 'd':
+				diff = 1;
+				break;
+			case 'V':
+				verify = 1;
+				break;
+			case 'p':
+				showPlan = 1;
+				break;
+			case 'G':
+				timing = 1;
+				break;
 			case 'm':
 				subopts = optarg;
 				switch (getsubopt(&subopts, token_media, &value)) {
@@ -571,6 +3865,9 @@ int main(int argc, char* argv[])
 						kbps = 300;
 						drate = 1;
 						break;
+					case OPT_AUTO:
+						detect = DETECT_MEDIA | DETECT_RANGE;
+						break;
 					default:
 						fprintf(stderr, "No match found for token: %s\n", value);
 						break;
@@ -592,6 +3889,7 @@ int main(int argc, char* argv[])
 				break;
 			case 'C':
 				sscanf(optarg,"%d-%d",&start, &end);
+				detect &= ~DETECT_RANGE;
 				break;
 			case 'S':
 				side = atoi(optarg);
@@ -605,6 +3903,67 @@ int main(int argc, char* argv[])
 			case 'R':
 				drate = atoi(optarg);
 				break;
+			case 'B':
+				cutoff = atoi(optarg);
+				break;
+			case 'P':
+				passes = atoi(optarg);
+				break;
+			case 'O':
+				subopts = optarg;
+				while (*subopts != '\0') {
+					switch (getsubopt(&subopts, token_optimize, &value)) {
+						case OPT_MULTI:
+							optimize |= OPTIMIZE_MULTI;
+							break;
+						case OPT_SCHED:
+							optimize |= OPTIMIZE_SCHED;
+							break;
+						case OPT_BATCH:
+							optimize |= OPTIMIZE_BATCH;
+							break;
+						case OPT_PREDICT:
+							optimize |= OPTIMIZE_PREDICT;
+							break;
+						case OPT_PROBE:
+							optimize |= OPTIMIZE_PROBE;
+							break;
+						case OPT_FILL:
+							optimize |= OPTIMIZE_FILL;
+							break;
+						case OPT_MT:
+							optimize |= OPTIMIZE_MT;
+							break;
+						case OPT_CAPTURE:
+							optimize |= OPTIMIZE_CAPTURE;
+							break;
+						default:
+							fprintf(stderr, "No match found for token: %s\n", value);
+							break;
+					}
+				}
+				break;
+			case 'E':
+				emuimage = optarg;
+				break;
+			case 'K':
+				profname = optarg;
+				break;
+			case 'A':
+				cachename = optarg;
+				break;
+			case 'J':
+				reportname = optarg;
+				break;
+			case 'L':
+				logname = optarg;
+				break;
+			case 'T':
+				tracename = optarg;
+				break;
+			case 'Y':
+				replayname = optarg;
+				break;
 			default:
 				fprintf(stderr, "error: invalid option\n");
 				exit(1);
@@ -612,12 +3971,138 @@ int main(int argc, char* argv[])
 		}
 	}
 	
+	/* Get command and filename */
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+		usage();
+		exit(0);
+	}
+	filename = argv[1];
+	snprintf(timename, sizeof(timename), "%s.tim", filename);
+	
+	/* Timing map is read without the drive */
+	if (strncmp(argv[0], "timing", 6) == 0) {
+		exit((printTimingMap(timename, start, end, side) == 0) ? 0 : 1);
+	}
+	
+	/* Media of restore comes from the image */
+	if ((detect != 0) && (strncmp(argv[0], "restore", 7) == 0)) {
+		fprintf(stderr, "error: -mauto is for reading disks\n");
+		exit(1);
+	}
+	
+	/* Index and validate restore image before touching the drive */
+	if ((strncmp(argv[0], "restore", 7) == 0) && (d88Open(&img, filename, MAXSECNUM) != 0)) {
+		exit(1);
+	}
+	
 	/* Calculate unformat track length */
-	trklen = (60 * kbps * 1000) / (rpm * 8);
+	trklen = calcTrackLength(rpm, kbps);
+	
+	/* Open stream of finished tracks */
+	if ((logname != NULL) && ((Report.log = fopen(logname, "w")) == NULL)) {
+		perror("fopen");
+		exit(1);
+	}
+	
+	/* Compile restore plan before touching the drive */
+	if (strncmp(argv[0], "restore", 7) == 0) {
+		if ((tracks = compileRestorePlan(&plan, &img, start, end, side, trklen)) < 0) {
+			exit(1);
+		}
+		if ((timing != 0) && (applyTimingMap(timename, &img, plan, tracks, trklen) != 0)) {
+			exit(1);
+		}
+		if (showPlan != 0) {
+			printRestorePlan(plan, tracks);
+			exit(0);
+		}
+	}
+	
+	/* Select FDC backend */
+	if (emuimage != NULL) {
+		fdcSetBackend(&fdcEmulator, emuimage);
+	} else if (replayname != NULL) {
+		fdcSetBackend(&fdcReplay, replayname);
+	}
+	fdcSetRpm(rpm);
+	if ((tracename != NULL) && (fdcTraceOpen(tracename) != 0)) {
+		exit(1);
+	}
+	if (fdcInit() != 0) {
+		exit(1);
+	}
+	
+	/* Check write protect (batch checks each disk) */
+	if ((protect < 0) && (strncmp(argv[0], "batch", 5) != 0)) {
+		protect = D88_PROTECT_OFF;
+		fdcSenseDrive(FD_DEVNUM, &sens);
+		if ((sens.st3 & FDC_ST3_WP) != 0) {
+			protect = D88_PROTECT_ON;
+		}
+	}
+	
+	/* Open destination drive of copy */
+	if (strncmp(argv[0], "copy", 4) == 0) {
+		if (emuimage != NULL) {
+			dst = FD_DEVNUM + 1;
+		} else if (sscanf(filename, "/dev/fd%d", &dst) != 1) {
+			fprintf(stderr, "error: destination must be a floppy drive\n");
+			exit(1);
+		}
+		if ((dst == FD_DEVNUM) || (dst < 0) || (dst > 3)) {
+			fprintf(stderr, "error: invalid destination unit %d\n", dst);
+			exit(1);
+		}
+		if (fdcOpen(dst, filename) != 0) {
+			fdcExit();
+			exit(1);
+		}
+		fdcSenseDrive(dst, &sens);
+		if ((sens.st3 & FDC_ST3_WP) != 0) {
+			fprintf(stderr, "error: destination is write protected\n");
+			fdcExit();
+			exit(1);
+		}
+	}
+	
+	/* Detect media of the disk (batch detects each disk) */
+	if ((detect != 0) && (strncmp(argv[0], "batch", 5) != 0)) {
+		if (detectMedia(FD_DEVNUM, cachename, &mi) != 0) {
+			fdcExit();
+			exit(1);
+		}
+		media = mi.media;
+		side = mi.side;
+		mult = mi.mult;
+		rpm = mi.rpm;
+		kbps = mi.kbps;
+		drate = mi.drate;
+		if ((detect & DETECT_RANGE) != 0) {
+			end = mi.end;
+		}
+		fdcSetRpm(rpm);
+		trklen = calcTrackLength(rpm, kbps);
+	}
 	
 	/* Set FDC DRATE register */
 	fdcSetDataRate(drate);
 	
+	/* Apply seek profile calibrated for the drives */
+	if ((profname != NULL) && (strncmp(argv[0], "calibrate", 9) != 0)) {
+		getDriveName(drive, sizeof(drive), FD_DEVNUM, emuimage != NULL);
+		if (applySeekProfile(FD_DEVNUM, profname, drive) != 0) {
+			fdcExit();
+			exit(1);
+		}
+		getDriveName(drive, sizeof(drive), dst, emuimage != NULL);
+		if ((dst >= 0) && (applySeekProfile(dst, profname, drive) != 0)) {
+			fdcExit();
+			exit(1);
+		}
+	}
+	
 	/* Seek floppy track 0 */
 	do {
 		if (fdcRecalibrate(FD_DEVNUM, &intr) != 0){
@@ -625,22 +4110,52 @@ int main(int argc, char* argv[])
 			exit(1);
 		}
 	} while((intr.st0 & FDC_ST0_EC) != 0);
-	
-	/* Get command and filename */
-	argc -= optind;
-	argv += optind;
-	if (argc != 2) {
-		usage();
-		exit(0);
+	if (dst >= 0) {
+		do {
+			if (fdcRecalibrate(dst, &intr) != 0){
+				fprintf(stderr, "fdcRecalibrate error\n");
+				exit(1);
+			}
+		} while((intr.st0 & FDC_ST0_EC) != 0);
 	}
-	filename = argv[1];
+	
 	if (strncmp(argv[0], "dump", 4) == 0) {
-		dumpFloppyDisk(start, end, mult, side, media, protect, filename);
+		if (passes > 0) {
+			snprintf(mapname, sizeof(mapname), "%s.map", filename);
+			if (dumpFloppyDisk(start, end, mult, side, media, protect, cutoff, resume, trklen, filename, mapname, (timing != 0) ? timename : NULL, NULL) == 0) {
+				rescueFloppyDisk(end, mult, passes, filename, mapname);
+			}
+		} else {
+			dumpFloppyDisk(start, end, mult, side, media, protect, cutoff, resume, trklen, filename, NULL, (timing != 0) ? timename : NULL, NULL);
+		}
 	} else if (strncmp(argv[0], "restore", 7) == 0) {
-		restoreFloppyDisk(start, end, mult, side, trklen, filename);
+		restoreFloppyDisk(mult, side, trklen, diff, verify, &img, plan, tracks);
+		free(plan);
+		d88Close(&img);
+	} else if (strncmp(argv[0], "calibrate", 9) == 0) {
+		getDriveName(drive, sizeof(drive), FD_DEVNUM, emuimage != NULL);
+		calibrateFloppyDrive(FD_DEVNUM, drive, start, end, mult, kbps, filename);
+	} else if (strncmp(argv[0], "batch", 5) == 0) {
+		mi.media = media;
+		mi.end = end;
+		mi.side = side;
+		mi.mult = mult;
+		mi.rpm = rpm;
+		mi.kbps = kbps;
+		mi.drate = drate;
+		batchFloppyDisk(start, &mi, protect, cutoff, passes, timing, detect, cachename, filename);
+	} else if (strncmp(argv[0], "copy", 4) == 0) {
+		copyFloppyDisk(FD_DEVNUM, dst, start, end, mult, side, trklen, verify);
 	} else {
 		usage();
 		exit(0);
 	}
+	if (reportname != NULL) {
+		writeStatsReport(reportname);
+	}
+	if (Report.log != NULL) {
+		fclose(Report.log);
+	}
 	fdcExit();
+	return 0;
 }
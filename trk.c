@@ -0,0 +1,212 @@
+/*
+ * Implementation for raw track stream decoder
+ *
+ * Copyright (c) 2021 stzlab
+ *
+ * This software is released under the MIT License, see LICENSE.
+ */
+
+#include "fdc.h"
+#include "d88.h"
+#include "trk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRK_MARK_ID		0xFE		/* ID address mark */
+#define TRK_MARK_DATA	0xFB		/* Data address mark */
+#define TRK_MARK_DEL	0xF8		/* Deleted data address mark */
+
+static unsigned short CrcTable[256];
+static int CrcReady = 0;
+
+/* CRC-CCITT (x^16 + x^12 + x^5 + 1), one table lookup per byte */
+unsigned short trkCrc(unsigned short crc, const unsigned char *buf, int len)
+{
+	int cnt;
+	int bit;
+	unsigned short val;
+
+	if (CrcReady == 0) {
+		for (cnt = 0; cnt < 256; cnt++) {
+			val = cnt << 8;
+			for (bit = 0; bit < 8; bit++) {
+				val = (val & 0x8000) ? (val << 1) ^ 0x1021 : (val << 1);
+			}
+			CrcTable[cnt] = val;
+		}
+		CrcReady = 1;
+	}
+	while (len-- > 0) {
+		crc = (crc << 8) ^ CrcTable[((crc >> 8) ^ *buf++) & 0xff];
+	}
+	return crc;
+}
+
+/* Copy bytes starting at any bit position, beyond the stream is zero */
+static void trkGetBytes(const unsigned char *raw, long len, long bit, unsigned char *buf, int num)
+{
+	long idx = bit >> 3;
+	int shift = bit & 7;
+
+	for (; num > 0; num--, idx++) {
+		*buf++ = (idx < len) ? ((raw[idx] << shift) | ((shift && (idx + 1 < len)) ? raw[idx + 1] >> (8 - shift) : 0)) : 0;
+	}
+}
+
+/* Search address mark after sync in a bit range, returns the bit next to the mark */
+static long trkFindMark(const unsigned char *raw, long len, int enc, long bit, long limit, unsigned char *mark)
+{
+	unsigned int win = 0;
+	long pos;
+
+	if (limit > len * 8) {
+		limit = len * 8;
+	}
+	for (pos = bit; pos < limit; pos++) {
+		win = (win << 1) | ((raw[pos >> 3] >> (7 - (pos & 7))) & 1);
+		if (pos - bit < 31) {
+			continue;
+		}
+		/* MFM: A1 A1 A1 mark, FM: 00 00 00 mark (clock pattern is not in the decoded stream) */
+		if (((enc == D88_ENCODE_MFM) && ((win >> 8) == 0xa1a1a1)) || ((enc == D88_ENCODE_FM) && ((win >> 8) == 0x000000))) {
+			*mark = win & 0xff;
+			if ((*mark == TRK_MARK_ID) || (*mark == TRK_MARK_DATA) || (*mark == TRK_MARK_DEL)) {
+				return pos + 1;
+			}
+		}
+	}
+	return -1;
+}
+
+/* CRC of a field from its sync marks, 0 when the field is good */
+static unsigned short trkCheckField(const unsigned char *raw, long len, int enc, unsigned char mark, long bit, int num)
+{
+	unsigned char buf[NSECSIZE(8) + 2];
+	unsigned char sync[] = { 0xa1, 0xa1, 0xa1, mark };
+	unsigned short crc;
+
+	crc = (enc == D88_ENCODE_MFM) ? trkCrc(0xffff, sync, 4) : trkCrc(0xffff, &sync[3], 1);
+	trkGetBytes(raw, len, bit, buf, num + 2);
+	return trkCrc(crc, buf, num + 2);
+}
+
+/* Decode sectors of one revolution from a READ TRACK stream starting at the data of the first
+   sector after the index, returns sectors in physical order or -1 when the layout is not certain */
+int trkDecode(const unsigned char *raw, long len, int enc, long revLen, struct trk_sector *sec, int max)
+{
+	int cnt;
+	int num = 0;
+	int first = -1;
+	long bit = 0;
+	long pos;
+	long rev = -1;
+	long gap2 = (enc == D88_ENCODE_MFM) ? 60 * 8 : 40 * 8;
+	unsigned char mark;
+	unsigned char id[4];
+	struct trk_sector *s;
+	struct trk_sector top;
+
+	/* Collect every ID and the data address mark following it within GAP2 */
+	while ((num < max) && ((pos = trkFindMark(raw, len, enc, bit, len * 8, &mark)) >= 0)) {
+		bit = pos;
+		if (mark != TRK_MARK_ID) {
+			continue;
+		}
+		if (pos + 6 * 8 > len * 8) {
+			break;
+		}
+		s = &sec[num++];
+		trkGetBytes(raw, len, pos, id, 4);
+		memcpy(&s->id, id, sizeof(s->id));
+		s->idBit = pos - 8;
+		s->dataBit = -1;
+		s->dam = D88_DAM_NORMAL;
+		s->status = 0x00;
+		bit = pos + 6 * 8;
+		if (trkCheckField(raw, len, enc, TRK_MARK_ID, pos, 4) != 0) {
+			s->status = D88_STATUS_DE;
+		}
+		if ((pos = trkFindMark(raw, len, enc, bit, bit + gap2, &mark)) < 0) {
+			/* Stream ended in GAP2 */
+			s->status = (bit + gap2 > len * 8) ? D88_STATUS_ER : D88_STATUS_MD;
+			continue;
+		}
+		if (mark == TRK_MARK_ID) {
+			s->status = D88_STATUS_MD;
+			continue;
+		}
+		s->dataBit = pos;
+		s->dam = (mark == TRK_MARK_DEL) ? D88_DAM_DELETED : D88_DAM_NORMAL;
+		bit = pos;
+	}
+	if (num == 0) {
+		return -1;
+	}
+
+	/* Revolution length from the first ID seen again */
+	for (cnt = 1; cnt < num; cnt++) {
+		pos = sec[cnt].idBit - sec[0].idBit;
+		if ((memcmp(&sec[cnt].id, &sec[0].id, sizeof(sec[0].id)) == 0) && (labs(pos - revLen * 8) <= revLen * 8 / 20)) {
+			rev = pos;
+			break;
+		}
+	}
+	/* Only the first sector, its data is one revolution after the beginning */
+	if ((rev < 0) && (num == 1) && (labs(sec[0].dataBit - revLen * 8) <= revLen * 8 / 20)) {
+		rev = sec[0].dataBit;
+	}
+	if (rev < 0) {
+		return -1;
+	}
+	/* First sector after the index comes again where its data began the stream */
+	for (cnt = 0; cnt < num; cnt++) {
+		if ((sec[cnt].dataBit >= 0) && (labs(sec[cnt].dataBit - rev) <= 16)) {
+			first = cnt;
+			break;
+		}
+	}
+	if (first < 0) {
+		return -1;
+	}
+	/* Sector without data field could be before the first one, order is not certain */
+	for (cnt = 0; cnt < first; cnt++) {
+		if ((sec[cnt].status == D88_STATUS_MD) || (sec[cnt].status == D88_STATUS_ER)) {
+			return -1;
+		}
+	}
+	/* Move the first sector to the top and take its data at the beginning of the stream */
+	top = sec[first];
+	top.dataBit = (top.dataBit - rev > 0) ? top.dataBit - rev : 0;
+	memmove(&sec[1], &sec[0], sizeof(*sec) * first);
+	sec[0] = top;
+	num = first + 1;
+
+	/* Check data CRC of each sector */
+	for (cnt = 0; cnt < num; cnt++) {
+		s = &sec[cnt];
+		if ((s->status != 0x00) || (s->dataBit < 0)) {
+			continue;
+		}
+		if (s->dataBit + (NSECSIZE(s->id.n) + 2) * 8 > len * 8) {
+			return -1;
+		}
+		if (trkCheckField(raw, len, enc, (s->dam == D88_DAM_DELETED) ? TRK_MARK_DEL : TRK_MARK_DATA,
+			s->dataBit, NSECSIZE(s->id.n)) != 0) {
+			s->status = D88_STATUS_DD;
+		} else if (s->dam == D88_DAM_DELETED) {
+			s->status = D88_STATUS_CM;
+		}
+	}
+	return num;
+}
+
+/* Copy data of a sector, size of N */
+void trkGetData(const unsigned char *raw, long len, struct trk_sector *sec, unsigned char *data)
+{
+	if (sec->dataBit < 0) {
+		memset(data, 0, NSECSIZE(sec->id.n));
+		return;
+	}
+	trkGetBytes(raw, len, sec->dataBit, data, NSECSIZE(sec->id.n));
+}
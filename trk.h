@@ -0,0 +1,20 @@
+/*
+ * Definition for raw track stream decoder
+ *
+ * Copyright (c) 2021 stzlab
+ *
+ * This software is released under the MIT License, see LICENSE.
+ */
+
+/* Sector found in the raw track stream */
+struct trk_sector {
+	struct fdc_sector_id id;
+	unsigned char status;		/* D88 status */
+	unsigned char dam;			/* D88 data address mark */
+	long idBit;					/* Bit position of ID address mark */
+	long dataBit;				/* Bit position of data, -1: no data address mark */
+};
+
+unsigned short trkCrc(unsigned short crc, const unsigned char *buf, int len);
+int trkDecode(const unsigned char *raw, long len, int enc, long revLen, struct trk_sector *sec, int max);
+void trkGetData(const unsigned char *raw, long len, struct trk_sector *sec, unsigned char *data);